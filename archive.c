@@ -0,0 +1,672 @@
+/* archive.c - Embeddable archive handle (libarchiver) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "archive.h"
+#include "record.h"
+#include "shard.h"
+#include "rekey.h"
+#include "backup.h"
+
+struct Archive {
+    struct ShardSet shards;
+    struct CipherKey key;           /* derived once, when the handle is opened */
+    int keyed;                      /* key's salt is the one recorded in the archive */
+    char* password;                 /* kept to read backups made under another salt */
+    pthread_rwlock_t lock;          /* shared for reads, exclusive for writes */
+    pthread_mutex_t pool_lock;
+    struct FrameBuffers* pool;      /* idle scratch buffers, one per past concurrent caller */
+};
+
+/* Context for archive_get's visitor */
+struct GetContext {
+    char* buffer;
+    int size;
+    int length;
+};
+
+/* Context for archive_scan's visitor, tracking a stop across shards */
+struct ScanContext {
+    record_visitor visit;
+    void* context;
+    int stopped;
+};
+
+/* Take a set of scratch buffers from the pool, allocating one only when
+ * every pooled set is in use by another thread */
+static struct FrameBuffers* acquire_buffers(struct Archive* archive)
+{
+    struct FrameBuffers* buffers;
+
+    pthread_mutex_lock(&archive->pool_lock);
+    buffers = archive->pool;
+    if (buffers != NULL) {
+        archive->pool = buffers->next;
+    }
+    pthread_mutex_unlock(&archive->pool_lock);
+
+    if (buffers == NULL) {
+        buffers = (struct FrameBuffers*)malloc(sizeof(struct FrameBuffers));
+        if (buffers == NULL || !init_frame_buffers(buffers)) {
+            free(buffers);
+            return NULL;
+        }
+    }
+    return buffers;
+}
+
+static void release_buffers(struct Archive* archive, struct FrameBuffers* buffers)
+{
+    pthread_mutex_lock(&archive->pool_lock);
+    buffers->next = archive->pool;
+    archive->pool = buffers;
+    pthread_mutex_unlock(&archive->pool_lock);
+}
+
+static void release_buffer_list(struct Archive* archive, struct FrameBuffers* list)
+{
+    struct FrameBuffers* buffers;
+
+    while (list != NULL) {
+        buffers = list;
+        list = list->next;
+        release_buffers(archive, buffers);
+    }
+}
+
+/* Take count sets of buffers from the pool, linked through next, for
+ * the worker threads of one parallel load or verify */
+static struct FrameBuffers* acquire_buffer_list(struct Archive* archive, int count)
+{
+    struct FrameBuffers* list = NULL;
+    struct FrameBuffers* buffers;
+
+    while (count-- > 0) {
+        buffers = acquire_buffers(archive);
+        if (buffers == NULL) {
+            release_buffer_list(archive, list);
+            return NULL;
+        }
+        buffers->next = list;
+        list = buffers;
+    }
+    return list;
+}
+
+static char* copy_password(const char* password)
+{
+    char* copy = (char*)malloc(strlen(password) + 1);
+    if (copy == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for archive\n");
+        return NULL;
+    }
+    strcpy(copy, password);
+    return copy;
+}
+
+static void free_password(char* password)
+{
+    if (password != NULL) {
+        memset(password, 0, strlen(password));
+        free(password);
+    }
+}
+
+/* Find the salt and check value of an archive: in the manifest of a
+ * shard directory, in the header of a single file. Returns 1 if found, 0
+ * if the archive has none yet (it is new or predates CIPHER_VERSION), -1
+ * on error. */
+static int read_archive_keying(struct ShardSet* set, unsigned char* salt, unsigned char* check)
+{
+    FILE* file;
+    int version;
+
+    if (set->sharded) {
+        if (!read_shard_manifest(set)) {
+            return -1;
+        }
+        memcpy(salt, set->salt, CIPHER_SALT_SIZE);
+        memcpy(check, set->check, CIPHER_CHECK_SIZE);
+        return set->keyed;
+    }
+
+    file = fopen(set->path, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    version = read_archive_keyed_header(file, salt, check);
+    fclose(file);
+    if (version == 0) {
+        fprintf(stderr, "Error: Invalid archive format\n");
+        return -1;
+    }
+    return version >= CIPHER_VERSION;
+}
+
+/* Take on keying another handle recorded since this one was opened
+ * without any: the key is derived again from the password and the
+ * recorded salt, and must match the recorded check value. */
+static int adopt_archive_keying(struct Archive* archive, const unsigned char* salt,
+                                const unsigned char* check)
+{
+    struct CipherKey key;
+
+    if (!derive_cipher_key(archive->password, salt, &key)) {
+        return 0;
+    }
+    if (!cipher_key_matches(&key, check)) {
+        fprintf(stderr, "Error: Wrong password for archive '%s'\n", archive->shards.path);
+        wipe_cipher_key(&key);
+        return 0;
+    }
+    wipe_cipher_key(&archive->key);
+    archive->key = key;
+    archive->keyed = 1;
+    return 1;
+}
+
+/* Record the handle's keying in an archive that has none, which is new
+ * or predates CIPHER_VERSION. Every frame of every older-format file
+ * must decode under the key first, since the archive answers only to
+ * it from then on. A shard directory records the keying in its
+ * manifest; a single file does as its header is rewritten by the write
+ * that follows. */
+static int record_archive_keying(struct Archive* archive)
+{
+    struct ShardSet* set = &archive->shards;
+    char filename[MAX_PATH_LENGTH];
+    int shard;
+
+    for (shard = 0; shard < set->count; shard++) {
+        shard_file_name(set, shard, filename, sizeof(filename));
+        if (!archive_file_decodes(filename, &archive->key)) {
+            return 0;
+        }
+    }
+
+    if (set->sharded) {
+        set->keyed = 1;
+        memcpy(set->salt, archive->key.salt, CIPHER_SALT_SIZE);
+        memcpy(set->check, archive->key.check, CIPHER_CHECK_SIZE);
+        if (!save_shard_manifest(set)) {
+            return 0;
+        }
+        archive->keyed = 1;
+    }
+    return 1;
+}
+
+/* Writers hold the handle's lock exclusively and the archive's writer
+ * lock, which serialises them with other handles and processes. Under
+ * that lock the archive's keying is read again: an archive re-keyed by
+ * another handle since this one was opened is refused, and one without
+ * keying gets this handle's. Returns the lock descriptor, or -1 (with
+ * the handle unlocked) on error. */
+static int begin_write(struct Archive* archive)
+{
+    unsigned char salt[CIPHER_SALT_SIZE];
+    unsigned char check[CIPHER_CHECK_SIZE];
+    struct ShardSet* set = &archive->shards;
+    int found;
+    int ok;
+    int fd;
+
+    pthread_rwlock_wrlock(&archive->lock);
+    fd = lock_shard_set(set);
+    if (fd >= 0) {
+        found = read_archive_keying(set, salt, check);
+        if (found == 0) {
+            ok = record_archive_keying(archive);
+        } else if (found < 0) {
+            ok = 0;
+        } else if (archive_key_matches(&archive->key, salt, check)) {
+            archive->keyed = 1;
+            ok = 1;
+        } else if (archive->keyed) {
+            fprintf(stderr, "Error: Archive '%s' was re-keyed since it was opened\n", set->path);
+            ok = 0;
+        } else {
+            ok = adopt_archive_keying(archive, salt, check);  /* keyed by another handle first */
+        }
+        if (!ok) {
+            unlock_shard_set(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+        pthread_rwlock_unlock(&archive->lock);
+    }
+    return fd;
+}
+
+static void end_write(struct Archive* archive, int fd)
+{
+    unlock_shard_set(fd);
+    pthread_rwlock_unlock(&archive->lock);
+}
+
+/* Derive the handle's key from the password and the archive's salt,
+ * and check it against the archive's check value. An archive without
+ * keying gets a fresh random salt, which is only recorded by the first
+ * write, so opening never changes the archive. */
+static int open_archive_key(struct Archive* archive, const char* password)
+{
+    unsigned char salt[CIPHER_SALT_SIZE];
+    unsigned char check[CIPHER_CHECK_SIZE];
+    int found = read_archive_keying(&archive->shards, salt, check);
+
+    if (found == 0) {
+        return generate_cipher_salt(salt) && derive_cipher_key(password, salt, &archive->key);
+    }
+    if (found < 0 || !derive_cipher_key(password, salt, &archive->key)) {
+        return 0;
+    }
+    if (!cipher_key_matches(&archive->key, check)) {
+        fprintf(stderr, "Error: Wrong password for archive '%s'\n", archive->shards.path);
+        return 0;
+    }
+    archive->keyed = 1;
+    return 1;
+}
+
+/* Open an archive file or shard directory. Nothing is written: if
+ * nothing exists at path, the first write creates a single-file archive.
+ * Returns NULL on error, including a password that does not match the
+ * archive's key check value. */
+struct Archive* archive_open(const char* path, const char* password)
+{
+    struct Archive* archive;
+
+    if (password == NULL || password[0] == '\0') {
+        fprintf(stderr, "Error: Archive password must not be empty\n");
+        return NULL;
+    }
+
+    archive = (struct Archive*)calloc(1, sizeof(struct Archive));
+    if (archive == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for archive\n");
+        return NULL;
+    }
+
+    if (!open_shard_set(path, &archive->shards)) {
+        free(archive);
+        return NULL;
+    }
+
+    pthread_rwlock_init(&archive->lock, NULL);
+    pthread_mutex_init(&archive->pool_lock, NULL);
+    archive->pool = NULL;
+
+    archive->password = copy_password(password);
+    if (archive->password == NULL || !open_archive_key(archive, password)) {
+        archive_close(archive);
+        return NULL;
+    }
+    return archive;
+}
+
+/* Create a new, empty sharded archive directory */
+int archive_create_sharded(const char* path, int shard_count)
+{
+    struct ShardSet set;
+    return create_shard_set(path, shard_count, &set);
+}
+
+/* Close an archive handle, wiping its key */
+void archive_close(struct Archive* archive)
+{
+    struct FrameBuffers* buffers;
+
+    if (archive == NULL) {
+        return;
+    }
+
+    while (archive->pool != NULL) {
+        buffers = archive->pool;
+        archive->pool = buffers->next;
+        free_frame_buffers(buffers);
+        free(buffers);
+    }
+
+    wipe_cipher_key(&archive->key);
+    free_password(archive->password);
+    pthread_mutex_destroy(&archive->pool_lock);
+    pthread_rwlock_destroy(&archive->lock);
+    free(archive);
+}
+
+int archive_shard_count(const struct Archive* archive)
+{
+    return archive->shards.count;
+}
+
+int archive_is_sharded(const struct Archive* archive)
+{
+    return archive->shards.sharded;
+}
+
+static int copy_record_data(const struct Record* record, void* context)
+{
+    struct GetContext* get = (struct GetContext*)context;
+
+    get->length = strlen(record->data);
+    if (get->size > 0) {
+        int copied = (get->length < get->size) ? get->length : get->size - 1;
+        memcpy(get->buffer, record->data, copied);
+        get->buffer[copied] = '\0';
+    }
+    return 0; /* IDs are unique, so stop at the first match */
+}
+
+/* Copy the data of record id into buffer, truncating to size - 1 bytes.
+ * Returns the full data length, or -1 if there is no such record. */
+int archive_get(struct Archive* archive, unsigned int id, char* buffer, int size)
+{
+    char filename[MAX_PATH_LENGTH];
+    struct RecordFilter filter;
+    struct GetContext get;
+    struct FrameBuffers* buffers = acquire_buffers(archive);
+
+    if (buffers == NULL) {
+        return -1;
+    }
+
+    memset(&filter, 0, sizeof(filter));
+    filter.id = id;
+    get.buffer = buffer;
+    get.size = size;
+    get.length = -1;
+
+    pthread_rwlock_rdlock(&archive->lock);
+    shard_file_name(&archive->shards, shard_for_id(&archive->shards, id), filename, sizeof(filename));
+    scan_records(filename, &archive->key, &filter, buffers, copy_record_data, &get);
+    pthread_rwlock_unlock(&archive->lock);
+
+    release_buffers(archive, buffers);
+    return get.length;
+}
+
+/* Store a new record, appending it to the one shard that owns its ID.
+ * Empty records are rejected, since an empty frame marks a deletion.
+ * Returns the new record's ID, or 0 on error. */
+unsigned int archive_put(struct Archive* archive, const char* data)
+{
+    char filename[MAX_PATH_LENGTH];
+    struct Record record;
+    struct FrameBuffers* buffers;
+    int fd;
+    int ok;
+
+    if (data == NULL || data[0] == '\0') {
+        fprintf(stderr, "Error: Record data must not be empty\n");
+        return 0;
+    }
+
+    buffers = acquire_buffers(archive);
+    if (buffers == NULL) {
+        return 0;
+    }
+
+    record.data = (char*)data;
+    record.created = time(NULL);
+    record.modified = record.created;
+    record.next = NULL;
+
+    fd = begin_write(archive);
+    if (fd < 0) {
+        release_buffers(archive, buffers);
+        return 0;
+    }
+
+    /* Reserve the ID and generation before writing so a failed append
+     * never reuses them */
+    ok = reserve_sequence_numbers(&archive->shards, 1, 1, &record.id, &record.generation);
+    if (ok) {
+        shard_file_name(&archive->shards, shard_for_id(&archive->shards, record.id),
+                        filename, sizeof(filename));
+        ok = append_record(filename, &archive->key, &record, buffers);
+    }
+
+    end_write(archive, fd);
+    release_buffers(archive, buffers);
+    return ok ? record.id : 0;
+}
+
+/* Delete the records with the given IDs. Each deletion gets its own
+ * generation and a delete marker so incremental backups carry it; only
+ * shards that lose a record are rewritten. Returns the number of records
+ * deleted, or -1 on error. */
+int archive_delete(struct Archive* archive, const unsigned int* ids, int count)
+{
+    char filename[MAX_PATH_LENGTH];
+    unsigned int* shard_ids;
+    struct FrameHeader* markers;
+    int deleted = 0;
+    int shard;
+    int fd;
+    int i;
+
+    shard_ids = (unsigned int*)malloc((count > 0 ? count : 1) * sizeof(unsigned int));
+    markers = (struct FrameHeader*)malloc((count > 0 ? count : 1) * sizeof(struct FrameHeader));
+    if (shard_ids == NULL || markers == NULL) {
+        free(shard_ids);
+        free(markers);
+        return -1;
+    }
+
+    fd = begin_write(archive);
+    if (fd < 0) {
+        free(shard_ids);
+        free(markers);
+        return -1;
+    }
+
+    for (shard = 0; deleted >= 0 && shard < archive->shards.count; shard++) {
+        unsigned int unused_id;
+        unsigned long long generation;
+        int found = 0;
+
+        for (i = 0; i < count; i++) {
+            if (shard_for_id(&archive->shards, ids[i]) == shard) {
+                shard_ids[found++] = ids[i];
+            }
+        }
+
+        shard_file_name(&archive->shards, shard, filename, sizeof(filename));
+        found = find_record_ids(filename, shard_ids, found);
+        if (found == 0) {
+            continue;
+        }
+
+        if (!reserve_sequence_numbers(&archive->shards, 0, found, &unused_id, &generation)) {
+            deleted = -1;
+            break;
+        }
+
+        for (i = 0; i < found; i++) {
+            markers[i].length = 0;
+            markers[i].id = shard_ids[i];
+            markers[i].created = time(NULL);
+            markers[i].modified = markers[i].created;
+            markers[i].generation = generation++;
+        }
+
+        if (remove_records(filename, &archive->key, markers, found) < 0) {
+            deleted = -1;
+        } else {
+            deleted += found;
+        }
+    }
+
+    end_write(archive, fd);
+    free(shard_ids);
+    free(markers);
+    return deleted;
+}
+
+static int forward_record(const struct Record* record, void* context)
+{
+    struct ScanContext* scan = (struct ScanContext*)context;
+
+    if (!scan->visit(record, scan->context)) {
+        scan->stopped = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/* Pass every record matching filter (NULL for all) to visit, shard by
+ * shard in file order, until visit returns 0. The record is only valid
+ * during the call. Returns the number of records visited. */
+int archive_scan(struct Archive* archive, const struct RecordFilter* filter,
+                 record_visitor visit, void* context)
+{
+    char filename[MAX_PATH_LENGTH];
+    struct ScanContext scan;
+    struct FrameBuffers* buffers = acquire_buffers(archive);
+    int visited = 0;
+    int shard;
+
+    if (buffers == NULL) {
+        return 0;
+    }
+
+    scan.visit = visit;
+    scan.context = context;
+    scan.stopped = 0;
+
+    pthread_rwlock_rdlock(&archive->lock);
+    for (shard = 0; !scan.stopped && shard < archive->shards.count; shard++) {
+        if (filter != NULL && filter->id != 0 && shard_for_id(&archive->shards, filter->id) != shard) {
+            continue;
+        }
+        shard_file_name(&archive->shards, shard, filename, sizeof(filename));
+        visited += scan_records(filename, &archive->key, filter, buffers, forward_record, &scan);
+    }
+    pthread_rwlock_unlock(&archive->lock);
+
+    release_buffers(archive, buffers);
+    return visited;
+}
+
+/* Load every record matching filter (NULL for all) into a list ordered
+ * by ID, loading shards in parallel. Returns the number loaded. */
+int archive_load(struct Archive* archive, const struct RecordFilter* filter, struct Record** head)
+{
+    struct Record* heads[MAX_SHARDS];
+    struct Record* merged;
+    struct FrameBuffers* buffers = acquire_buffer_list(archive, shard_thread_count(&archive->shards));
+    int loaded;
+
+    if (buffers == NULL) {
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&archive->lock);
+    loaded = load_shards(&archive->shards, &archive->key, filter, &buffers, heads);
+    pthread_rwlock_unlock(&archive->lock);
+    release_buffer_list(archive, buffers);
+
+    merged = merge_shards(heads, archive->shards.count);
+    if (merged != NULL) {
+        add_record(head, merged);
+    }
+    return loaded;
+}
+
+/* Free a list returned by archive_load */
+void archive_free_records(struct Record* head)
+{
+    free_records(head);
+}
+
+/* Decode every record of every shard in parallel. frames and bad_frames
+ * receive per-shard counts. Returns the total number of corrupt frames,
+ * or -1 on error. */
+int archive_verify(struct Archive* archive, int* frames, int* bad_frames)
+{
+    struct FrameBuffers* buffers = acquire_buffer_list(archive, shard_thread_count(&archive->shards));
+    int bad;
+
+    if (buffers == NULL) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&archive->lock);
+    bad = verify_shards(&archive->shards, &archive->key, &buffers, frames, bad_frames);
+    pthread_rwlock_unlock(&archive->lock);
+    release_buffer_list(archive, buffers);
+    return bad;
+}
+
+/* Re-encrypt the archive under a new password, which the handle uses
+ * from then on. Every frame must decode under the current password
+ * first. Returns the number of frames re-keyed, -1 on error with the
+ * archive unchanged, or ARCHIVE_REKEY_PARTIAL if the archive was left
+ * mixing both passwords. */
+int archive_rekey(struct Archive* archive, const char* new_password)
+{
+    unsigned char salt[CIPHER_SALT_SIZE];
+    struct CipherKey new_key;
+    char* password;
+    int frames = -1;
+    int fd;
+
+    if (new_password == NULL || new_password[0] == '\0') {
+        fprintf(stderr, "Error: New password must not be empty\n");
+        return -1;
+    }
+
+    /* Derive outside the lock; it is the slow part. The new key gets a
+     * salt of its own. */
+    password = copy_password(new_password);
+    if (password == NULL || !generate_cipher_salt(salt) || !derive_cipher_key(new_password, salt, &new_key)) {
+        free_password(password);
+        return -1;
+    }
+
+    fd = begin_write(archive);
+    if (fd >= 0) {
+        frames = rekey_archive(&archive->shards, &archive->key, &new_key);
+        if (frames >= 0) {
+            archive->key = new_key;
+            archive->keyed = 1;
+            free_password(archive->password);
+            archive->password = password;
+            password = NULL;
+        }
+        end_write(archive, fd);
+    }
+    free_password(password);
+
+    wipe_cipher_key(&new_key);
+    return frames;
+}
+
+/* Stream the changes from generation since onwards to output */
+int archive_backup(struct Archive* archive, unsigned long long since, FILE* output,
+                   unsigned long long* next_generation)
+{
+    int frames;
+
+    pthread_rwlock_rdlock(&archive->lock);
+    frames = backup_archive(&archive->shards, &archive->key, since, output, next_generation);
+    pthread_rwlock_unlock(&archive->lock);
+    return frames;
+}
+
+/* Apply a backup stream read from input */
+int archive_restore(struct Archive* archive, FILE* input)
+{
+    int applied;
+    int fd = begin_write(archive);
+
+    if (fd < 0) {
+        return -1;
+    }
+    applied = restore_archive(&archive->shards, &archive->key, archive->password, input);
+    end_write(archive, fd);
+    return applied;
+}
@@ -0,0 +1,72 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+/* Embeddable archive API (libarchiver).
+ *
+ * An Archive handle owns the open shard set, the key derived from the
+ * password and a pool of reusable frame buffers. Any number of threads
+ * may read through one handle at once (get, scan, load, verify, backup);
+ * writes (put, delete, rekey, restore) take the handle exclusively. */
+
+#include <stdio.h>
+#include <time.h>
+
+/* Only the functions declared with ARCHIVE_API are exported from the
+ * shared library; everything else stays internal to it */
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define ARCHIVE_API __attribute__((visibility("default")))
+#else
+#define ARCHIVE_API
+#endif
+
+struct Archive;
+
+/* archive_rekey result when a failed re-key could not be rolled back, so
+ * some shards are under each password; the details go to stderr */
+#define ARCHIVE_REKEY_PARTIAL (-2)
+
+/* A record as returned by archive_load and passed to archive_scan visitors */
+struct Record {
+    unsigned int id;
+    char *data;
+    time_t created;     /* 0 if unknown (written by an older format) */
+    time_t modified;
+    unsigned long long generation;  /* archive write sequence, 0 if unknown */
+    struct Record *next;
+};
+
+/* Optional constraints applied while loading; zero times mean unbounded */
+struct RecordFilter {
+    unsigned int id;        /* only this record ID, 0 for any */
+    const char* term;       /* substring to match, NULL for any */
+    time_t since;           /* earliest modification time, inclusive */
+    time_t until;           /* latest modification time, inclusive */
+};
+
+/* Called for each record found by archive_scan; return 0 to stop */
+typedef int (*record_visitor)(const struct Record* record, void* context);
+
+ARCHIVE_API struct Archive* archive_open(const char* path, const char* password);
+ARCHIVE_API int archive_create_sharded(const char* path, int shard_count);
+ARCHIVE_API void archive_close(struct Archive* archive);
+ARCHIVE_API int archive_shard_count(const struct Archive* archive);
+ARCHIVE_API int archive_is_sharded(const struct Archive* archive);
+
+/* Record access */
+ARCHIVE_API int archive_get(struct Archive* archive, unsigned int id, char* buffer, int size);
+ARCHIVE_API unsigned int archive_put(struct Archive* archive, const char* data);
+ARCHIVE_API int archive_delete(struct Archive* archive, const unsigned int* ids, int count);
+ARCHIVE_API int archive_scan(struct Archive* archive, const struct RecordFilter* filter,
+                             record_visitor visit, void* context);
+ARCHIVE_API int archive_load(struct Archive* archive, const struct RecordFilter* filter,
+                             struct Record** head);
+ARCHIVE_API void archive_free_records(struct Record* head);
+
+/* Whole-archive operations */
+ARCHIVE_API int archive_verify(struct Archive* archive, int* frames, int* bad_frames);
+ARCHIVE_API int archive_rekey(struct Archive* archive, const char* new_password);
+ARCHIVE_API int archive_backup(struct Archive* archive, unsigned long long since, FILE* output,
+                               unsigned long long* next_generation);
+ARCHIVE_API int archive_restore(struct Archive* archive, FILE* input);
+
+#endif
@@ -0,0 +1,346 @@
+/* backup.c - Incremental backup and restore by generation number */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "backup.h"
+#include "record.h"
+#include "timeindex.h"
+
+/* Delete markers collected for one shard during a restore */
+struct MarkerList {
+    struct FrameHeader* markers;
+    int count;
+    int capacity;
+};
+
+/* Copy up to max_frames frames (-1 for all) whose generation is at least
+ * since from input to output, seeking past older payloads. Payloads are
+ * copied still encrypted, only re-encrypted if they predate the current
+ * cipher; headers are rewritten in the current format. Returns the
+ * number copied, or -1 on a corrupt frame or write error. */
+static int copy_frames(FILE* input, int version, long max_frames, unsigned long long since,
+                       const struct CipherKey* key, FILE* output, char* payload,
+                       unsigned long long* max_generation)
+{
+    struct FrameHeader frame;
+    int copied = 0;
+    int status;
+
+    while (max_frames != 0 && (status = read_frame_header(input, version, 0, &frame)) != 0) {
+        if (max_frames > 0) {
+            max_frames--;
+        }
+        if (status < 0 || !frame_length_valid(version, &frame)) {
+            return -1;
+        }
+        if (frame.generation > *max_generation) {
+            *max_generation = frame.generation;
+        }
+
+        if (frame.generation < since) {
+            if (fseek(input, (long)frame.length, SEEK_CUR) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (fread(payload, 1, frame.length, input) != frame.length) {
+            return -1;
+        }
+        upgrade_frame_payload(key, version, &frame, payload);
+        if (!write_raw_frame(output, &frame, payload)) {
+            return -1;
+        }
+        copied++;
+    }
+    return copied;
+}
+
+/* Stream the new frames of one archive file. The time index lets whole
+ * regions older than since be skipped without reading their headers. */
+static int backup_file(const char* filename, unsigned long long since, const struct CipherKey* key,
+                       FILE* output, char* payload, unsigned long long* max_generation)
+{
+    struct TimeIndex index;
+    int copied = 0;
+    int i;
+
+    FILE* input = fopen(filename, "rb");
+    if (input == NULL) {
+        return 0; /* Shard never written */
+    }
+
+    int version = read_archive_header_for_key(input, filename, key);
+    if (version <= 0) {
+        if (version == 0) {
+            fprintf(stderr, "Error: Invalid archive format in '%s'\n", filename);
+        }
+        fclose(input);
+        return -1;
+    }
+
+    if (version >= 4 && since > 0 && load_time_index(filename, &index)) {
+        for (i = 0; copied >= 0 && i < index.count; i++) {
+            const struct TimeRegion* region = &index.regions[i];
+            int region_copied;
+
+            if (region->max_generation > *max_generation) {
+                *max_generation = region->max_generation;
+            }
+            if (region->max_generation < since) {
+                continue;
+            }
+            if (fseek(input, region->offset, SEEK_SET) != 0) {
+                copied = -1;
+                break;
+            }
+            region_copied = copy_frames(input, version, (long)region->frames, since,
+                                        key, output, payload, max_generation);
+            copied = (region_copied < 0) ? -1 : copied + region_copied;
+        }
+        if (copied >= 0) {
+            int tail_copied = -1;
+            if (fseek(input, index.covered, SEEK_SET) == 0) {
+                tail_copied = copy_frames(input, version, -1, since, key, output, payload, max_generation);
+            }
+            copied = (tail_copied < 0) ? -1 : copied + tail_copied;
+        }
+        free_time_index(&index);
+    } else {
+        copied = copy_frames(input, version, -1, since, key, output, payload, max_generation);
+    }
+
+    if (copied < 0) {
+        fprintf(stderr, "Error: Cannot back up '%s'\n", filename);
+    }
+    fclose(input);
+    return copied;
+}
+
+/* Write every frame and delete marker with a generation of at least since
+ * to output. Files keyed under anything but key are refused; the key
+ * itself is only needed to convert frames from files that predate the
+ * current cipher. next_generation receives the value to pass as since for the
+ * following incremental backup. Returns the number of frames written, or
+ * -1 on error. */
+int backup_archive(const struct ShardSet* set, const struct CipherKey* key, unsigned long long since,
+                   FILE* output, unsigned long long* next_generation)
+{
+    char filename[MAX_PATH_LENGTH];
+    char header[9];
+    unsigned long long max_generation = 0;
+    int total = 0;
+    int shard;
+
+    char* payload = malloc(MAX_FRAME_SIZE);
+    if (payload == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for backup\n");
+        return -1;
+    }
+
+    sprintf(header, "%s%d\n", BACKUP_MAGIC, ARCHIVE_VERSION);
+    if (fwrite(header, 1, 8, output) != 8 ||
+        fwrite(key->salt, 1, CIPHER_SALT_SIZE, output) != CIPHER_SALT_SIZE ||
+        fwrite(key->check, 1, CIPHER_CHECK_SIZE, output) != CIPHER_CHECK_SIZE) {
+        free(payload);
+        return -1;
+    }
+
+    for (shard = 0; shard < set->count; shard++) {
+        int copied;
+
+        shard_file_name(set, shard, filename, sizeof(filename));
+        copied = backup_file(filename, since, key, output, payload, &max_generation);
+        if (copied < 0) {
+            free(payload);
+            return -1;
+        }
+        total += copied;
+    }
+    free(payload);
+
+    if (fflush(output) != 0) {
+        return -1;
+    }
+
+    *next_generation = max_generation + 1;
+    if (set->sharded && set->next_generation > *next_generation) {
+        *next_generation = set->next_generation;
+    }
+    return total;
+}
+
+static int push_marker(struct MarkerList* list, const struct FrameHeader* marker)
+{
+    if (list->count == list->capacity) {
+        int capacity = (list->capacity == 0) ? 16 : list->capacity * 2;
+        struct FrameHeader* grown = (struct FrameHeader*)realloc(list->markers,
+                                        capacity * sizeof(struct FrameHeader));
+        if (grown == NULL) {
+            return 0;
+        }
+        list->markers = grown;
+        list->capacity = capacity;
+    }
+    list->markers[list->count++] = *marker;
+    return 1;
+}
+
+/* Read the key a backup stream was written under. Streams from archives
+ * with another salt are decrypted with a key derived from password and
+ * their salt, which must match their check value. Streams older than
+ * CIPHER_VERSION carry no key and use the archive's. Returns the stream
+ * version, or 0 on error. */
+static int read_backup_header(FILE* input, const struct CipherKey* key, const char* password,
+                              struct CipherKey* stream_key)
+{
+    unsigned char salt[CIPHER_SALT_SIZE];
+    unsigned char check[CIPHER_CHECK_SIZE];
+    char header[9];
+    int version;
+
+    if (fread(header, 1, 8, input) != 8 || memcmp(header, BACKUP_MAGIC, 6) != 0 ||
+        header[7] != '\n' || header[6] < '1' || header[6] > '0' + ARCHIVE_VERSION) {
+        fprintf(stderr, "Error: Invalid backup stream\n");
+        return 0;
+    }
+    version = header[6] - '0';
+    *stream_key = *key;
+    if (version < CIPHER_VERSION) {
+        return version;
+    }
+
+    if (fread(salt, 1, CIPHER_SALT_SIZE, input) != CIPHER_SALT_SIZE ||
+        fread(check, 1, CIPHER_CHECK_SIZE, input) != CIPHER_CHECK_SIZE) {
+        fprintf(stderr, "Error: Invalid backup stream\n");
+        return 0;
+    }
+    if (memcmp(salt, key->salt, CIPHER_SALT_SIZE) != 0 &&
+        !derive_cipher_key(password, salt, stream_key)) {
+        return 0;
+    }
+    if (!archive_key_matches(stream_key, salt, check)) {
+        fprintf(stderr, "Error: Backup stream was written under a different password\n");
+        wipe_cipher_key(stream_key);
+        return 0;
+    }
+    return version;
+}
+
+/* Apply a backup stream to an archive. Only frames newer than the
+ * archive's newest generation are applied (everything, if the archive is
+ * empty), so replaying a stream is harmless. Records are appended to the
+ * shard owning their ID, re-encrypted if the stream was written under
+ * another salt; delete markers are applied per shard in one pass at the
+ * end. Returns the number of frames applied, or -1 on error. */
+int restore_archive(struct ShardSet* set, const struct CipherKey* key, const char* password, FILE* input)
+{
+    struct CipherKey stream_key;
+    char filename[MAX_PATH_LENGTH];
+    FILE* outputs[MAX_SHARDS];
+    struct MarkerList pending[MAX_SHARDS];
+    struct FrameHeader frame;
+    unsigned int max_id;
+    unsigned long long max_generation;
+    unsigned long long apply_from;
+    int applied = 0;
+    int ok = 1;
+    int status;
+    int shard;
+
+    int version = read_backup_header(input, key, password, &stream_key);
+    if (version == 0) {
+        return -1;
+    }
+
+    /* Work out where the archive currently stands */
+    if (set->sharded) {
+        if (!read_shard_manifest(set)) {
+            wipe_cipher_key(&stream_key);
+            return -1;
+        }
+        max_id = set->next_id - 1;
+        max_generation = set->next_generation - 1;
+    } else {
+        scan_archive_maxima(set->path, &max_id, &max_generation);
+    }
+    apply_from = (max_id == 0 && max_generation == 0) ? 0 : max_generation + 1;
+
+    char* payload = malloc(MAX_FRAME_SIZE);
+    if (payload == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for restore\n");
+        wipe_cipher_key(&stream_key);
+        return -1;
+    }
+
+    memset(outputs, 0, sizeof(outputs));
+    memset(pending, 0, sizeof(pending));
+
+    while (ok && (status = read_frame_header(input, version, 0, &frame)) != 0) {
+        ok = status > 0 && frame_length_valid(version, &frame) &&
+             fread(payload, 1, frame.length, input) == frame.length;
+        if (!ok) {
+            fprintf(stderr, "Error: Corrupt frame in backup stream\n");
+            break;
+        }
+        if (frame.generation < apply_from) {
+            continue;
+        }
+
+        shard = shard_for_id(set, frame.id);
+        if (frame.length == 0) {
+            ok = push_marker(&pending[shard], &frame);
+        } else {
+            if (outputs[shard] == NULL) {
+                shard_file_name(set, shard, filename, sizeof(filename));
+                outputs[shard] = open_archive_for_append(filename, key);
+            }
+            if (version >= CIPHER_VERSION && memcmp(stream_key.salt, key->salt, CIPHER_SALT_SIZE) != 0) {
+                reencrypt_frame_payload(&stream_key, version, key, &frame, payload);
+            } else {
+                upgrade_frame_payload(key, version, &frame, payload);
+            }
+            ok = outputs[shard] != NULL && write_raw_frame(outputs[shard], &frame, payload);
+        }
+
+        if (frame.id > max_id) {
+            max_id = frame.id;
+        }
+        if (frame.generation > max_generation) {
+            max_generation = frame.generation;
+        }
+        applied++;
+    }
+    free(payload);
+
+    for (shard = 0; shard < set->count; shard++) {
+        shard_file_name(set, shard, filename, sizeof(filename));
+        if (outputs[shard] != NULL) {
+            if (fclose(outputs[shard]) != 0) {
+                ok = 0;
+            }
+            update_time_index(filename, 0);
+        }
+        if (ok && pending[shard].count > 0 &&
+            remove_records(filename, key, pending[shard].markers, pending[shard].count) < 0) {
+            ok = 0;
+        }
+        free(pending[shard].markers);
+    }
+
+    if (set->sharded) {
+        if (max_id + 1 > set->next_id) {
+            set->next_id = max_id + 1;
+        }
+        if (max_generation + 1 > set->next_generation) {
+            set->next_generation = max_generation + 1;
+        }
+        if (!save_shard_manifest(set)) {
+            ok = 0;
+        }
+    }
+
+    wipe_cipher_key(&stream_key);
+    return ok ? applied : -1;
+}
@@ -0,0 +1,17 @@
+#ifndef BACKUP_H
+#define BACKUP_H
+
+#include <stdio.h>
+#include "shard.h"
+
+/* Incremental backup streams start with "ARCHBKn\n", n being the frame
+ * format version, followed from CIPHER_VERSION on by the salt and check
+ * value of the key the frames are encrypted under, then frames copied
+ * from the archive */
+#define BACKUP_MAGIC "ARCHBK"
+
+int backup_archive(const struct ShardSet* set, const struct CipherKey* key, unsigned long long since,
+                   FILE* output, unsigned long long* next_generation);
+int restore_archive(struct ShardSet* set, const struct CipherKey* key, const char* password, FILE* input);
+
+#endif
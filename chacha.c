@@ -0,0 +1,149 @@
+/* chacha.c - ChaCha20 block function, scalar path and kernel dispatch */
+
+#include <string.h>
+#include <pthread.h>
+#include "chacha.h"
+
+#define ROTL32(v, n) ((((v) << (n)) | ((v) >> (32 - (n)))) & 0xffffffffU)
+
+#define QUARTER_ROUND(x, a, b, c, d) \
+    x[a] = (x[a] + x[b]) & 0xffffffffU; x[d] = ROTL32(x[d] ^ x[a], 16); \
+    x[c] = (x[c] + x[d]) & 0xffffffffU; x[b] = ROTL32(x[b] ^ x[c], 12); \
+    x[a] = (x[a] + x[b]) & 0xffffffffU; x[d] = ROTL32(x[d] ^ x[a], 8); \
+    x[c] = (x[c] + x[d]) & 0xffffffffU; x[b] = ROTL32(x[b] ^ x[c], 7)
+
+typedef unsigned long (*chacha_kernel)(const unsigned int* state, unsigned char* data, unsigned long blocks);
+
+/* No wide kernel: everything goes through the scalar block function */
+static unsigned long chacha20_blocks_none(const unsigned int* state, unsigned char* data, unsigned long blocks)
+{
+    (void)state;
+    (void)data;
+    (void)blocks;
+    return 0;
+}
+
+static chacha_kernel active_kernel = chacha20_blocks_none;
+static const char* active_kernel_name = "scalar";
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static int cpu_has_sse2(void)
+{
+#if defined(__GNUC__) && defined(__SSE2__)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static int cpu_has_avx2(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
+
+static int set_kernel(const char* name)
+{
+    if (strcmp(name, "avx2") == 0 && cpu_has_avx2()) {
+        active_kernel = chacha20_blocks_avx2;
+    } else if (strcmp(name, "sse2") == 0 && cpu_has_sse2()) {
+        active_kernel = chacha20_blocks_sse2;
+    } else if (strcmp(name, "scalar") == 0) {
+        active_kernel = chacha20_blocks_none;
+    } else {
+        return 0;
+    }
+    active_kernel_name = name;
+    return 1;
+}
+
+static void select_kernel(void)
+{
+    if (!set_kernel("avx2") && !set_kernel("sse2")) {
+        set_kernel("scalar");
+    }
+}
+
+/* Not safe while other threads are encrypting; meant for benchmarks */
+int chacha20_use_kernel(const char* name)
+{
+    pthread_once(&kernel_once, select_kernel);
+    return set_kernel(name);
+}
+
+const char* chacha20_kernel_name(void)
+{
+    pthread_once(&kernel_once, select_kernel);
+    return active_kernel_name;
+}
+
+/* XOR up to one block of data with the keystream block for state */
+static void chacha20_block_xor(const unsigned int* state, unsigned char* data, unsigned long length)
+{
+    unsigned int x[16];
+    unsigned long i;
+    int round;
+
+    memcpy(x, state, sizeof(x));
+    for (round = 0; round < 10; round++) {
+        QUARTER_ROUND(x, 0, 4, 8, 12);
+        QUARTER_ROUND(x, 1, 5, 9, 13);
+        QUARTER_ROUND(x, 2, 6, 10, 14);
+        QUARTER_ROUND(x, 3, 7, 11, 15);
+        QUARTER_ROUND(x, 0, 5, 10, 15);
+        QUARTER_ROUND(x, 1, 6, 11, 12);
+        QUARTER_ROUND(x, 2, 7, 8, 13);
+        QUARTER_ROUND(x, 3, 4, 9, 14);
+    }
+
+    for (i = 0; i < length; i++) {
+        unsigned int word = (x[i / 4] + state[i / 4]) & 0xffffffffU;
+        data[i] ^= (unsigned char)(word >> ((i % 4) * 8));
+    }
+}
+
+static unsigned int load_u32_le(const unsigned char* buffer)
+{
+    return (unsigned int)buffer[0] | ((unsigned int)buffer[1] << 8) |
+           ((unsigned int)buffer[2] << 16) | ((unsigned int)buffer[3] << 24);
+}
+
+void chacha20_xor(const unsigned int* key, const unsigned char* nonce, unsigned int counter,
+                  char* data, unsigned long length)
+{
+    unsigned char* bytes = (unsigned char*)data;
+    unsigned int state[16];
+    unsigned long done;
+
+    pthread_once(&kernel_once, select_kernel);
+
+    state[0] = 0x61707865;  /* "expand 32-byte k" */
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    memcpy(state + 4, key, CHACHA_KEY_WORDS * sizeof(unsigned int));
+    state[12] = counter;
+    state[13] = load_u32_le(nonce);
+    state[14] = load_u32_le(nonce + 4);
+    state[15] = load_u32_le(nonce + 8);
+
+    done = active_kernel(state, bytes, length / CHACHA_BLOCK_SIZE);
+    state[12] = (state[12] + (unsigned int)done) & 0xffffffffU;
+    bytes += done * CHACHA_BLOCK_SIZE;
+    length -= done * CHACHA_BLOCK_SIZE;
+
+    /* Blocks the wide kernel left over, then the partial tail */
+    while (length > 0) {
+        unsigned long take = (length < CHACHA_BLOCK_SIZE) ? length : CHACHA_BLOCK_SIZE;
+        chacha20_block_xor(state, bytes, take);
+        state[12] = (state[12] + 1) & 0xffffffffU;
+        bytes += take;
+        length -= take;
+    }
+
+    memset(state, 0, sizeof(state));
+}
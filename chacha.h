@@ -0,0 +1,25 @@
+#ifndef CHACHA_H
+#define CHACHA_H
+
+/* ChaCha20 stream cipher (RFC 8439) with SIMD kernels chosen at run time */
+
+#define CHACHA_KEY_WORDS 8
+#define CHACHA_NONCE_SIZE 12
+#define CHACHA_BLOCK_SIZE 64
+
+/* XOR data with the keystream for key and nonce, starting at block
+ * counter. Encryption and decryption are the same operation. */
+void chacha20_xor(const unsigned int* key, const unsigned char* nonce, unsigned int counter,
+                  char* data, unsigned long length);
+
+/* Kernel selection: the widest one the CPU supports is used unless a
+ * benchmark forces another ("scalar", "sse2" or "avx2") */
+const char* chacha20_kernel_name(void);
+int chacha20_use_kernel(const char* name);
+
+/* Wide kernels XOR as many whole blocks as they can, starting at the
+ * counter in state[12], and return the number of blocks processed */
+unsigned long chacha20_blocks_sse2(const unsigned int* state, unsigned char* data, unsigned long blocks);
+unsigned long chacha20_blocks_avx2(const unsigned int* state, unsigned char* data, unsigned long blocks);
+
+#endif
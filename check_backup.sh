@@ -0,0 +1,71 @@
+#!/bin/sh
+# check_backup.sh - Round trip a full and an incremental backup, with
+# deletions in between, through a single-file archive and a sharded one.
+# Usage: check_backup.sh <path to medical_archiver>
+
+ARCHIVER=${1:-./medical_archiver}
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+fail()
+{
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+add_records()
+{
+    archive=$1
+    shift
+    for data in "$@"; do
+        echo "$data" | "$ARCHIVER" --archive "$archive" --add > /dev/null || fail "cannot add '$data' to $archive"
+    done
+}
+
+# Generation to pass as --backup-since next, from a backup's report
+next_generation()
+{
+    sed -n 's/.*--backup-since \([0-9]*\).*/\1/p' "$1"
+}
+
+# round_trip <name> <shard count, 0 for a single file>
+round_trip()
+{
+    name=$1
+    shards=$2
+    source="$WORK/$name-source"
+    copy="$WORK/$name-copy"
+
+    if [ "$shards" -gt 0 ]; then
+        "$ARCHIVER" --archive "$source" --shards "$shards" > /dev/null || fail "cannot create $source"
+        "$ARCHIVER" --archive "$copy" --shards "$shards" > /dev/null || fail "cannot create $copy"
+    fi
+
+    add_records "$source" "name:Alice;age:25" "name:Bob;age:40" "name:Carol;diabetes" \
+                "name:Dan;age:61" "name:Eve;notes:$(printf '%0200d' 0)"
+    "$ARCHIVER" --archive "$source" --backup-since 0 > "$WORK/$name-full.bak" 2> "$WORK/$name-full.log" ||
+        fail "$name: full backup failed"
+    since=$(next_generation "$WORK/$name-full.log")
+    [ -n "$since" ] || fail "$name: full backup reported no next generation"
+
+    "$ARCHIVER" --archive "$source" --delete 2 > /dev/null || fail "$name: cannot delete record 2"
+    add_records "$source" "name:Frank;age:33" "name:Grace;flu"
+    "$ARCHIVER" --archive "$source" --delete 4 > /dev/null || fail "$name: cannot delete record 4"
+    "$ARCHIVER" --archive "$source" --backup-since "$since" > "$WORK/$name-incremental.bak" \
+        2> "$WORK/$name-incremental.log" || fail "$name: incremental backup failed"
+
+    "$ARCHIVER" --archive "$copy" --restore "$WORK/$name-full.bak" > /dev/null || fail "$name: full restore failed"
+    "$ARCHIVER" --archive "$copy" --restore "$WORK/$name-incremental.bak" > /dev/null ||
+        fail "$name: incremental restore failed"
+
+    "$ARCHIVER" --archive "$source" --export "$WORK/$name-source.txt" > /dev/null || fail "$name: cannot export source"
+    "$ARCHIVER" --archive "$copy" --export "$WORK/$name-copy.txt" > /dev/null || fail "$name: cannot export copy"
+    [ "$(wc -l < "$WORK/$name-source.txt")" -eq 5 ] || fail "$name: source should hold 5 records"
+    cmp -s "$WORK/$name-source.txt" "$WORK/$name-copy.txt" || fail "$name: restored records differ"
+    "$ARCHIVER" --archive "$copy" --verify > /dev/null || fail "$name: restored archive does not verify"
+
+    echo "PASS: $name backup round trip"
+}
+
+round_trip single 0
+round_trip sharded 4
@@ -0,0 +1,202 @@
+/* cipher_bench.c - Frame cipher throughput benchmark ("make bench")
+ *
+ * Checks ChaCha20 and PBKDF2-HMAC-SHA-256 against published test vectors
+ * and every ChaCha20 kernel the CPU supports against the scalar one,
+ * then reports single-thread throughput for full-size and small frames.
+ * With --check it stops after the checks ("make check"). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "encrypt.h"
+#include "chacha.h"
+#include "sha256.h"
+
+#define BENCH_SECONDS 1.0
+#define BENCH_BUFFER_SIZE 65536
+
+static const char* kernels[] = { "scalar", "sse2", "avx2" };
+
+/* RFC 8439 section 2.4.2: key 00..1f, this nonce, block counter 1 */
+static const unsigned char chacha_nonce[CHACHA_NONCE_SIZE] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x4a, 0x00, 0x00, 0x00, 0x00
+};
+static const char chacha_plaintext[] =
+    "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for "
+    "the future, sunscreen would be it.";
+static const unsigned char chacha_ciphertext[114] = {
+    0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 0x41, 0xba, 0x07, 0x28,
+    0xdd, 0x0d, 0x69, 0x81, 0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2,
+    0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f, 0xae, 0x0b, 0xf9, 0x1b, 0x65, 0xc5,
+    0x52, 0x47, 0x33, 0xab, 0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57,
+    0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab, 0x8f, 0x53, 0x0c, 0x35,
+    0x9f, 0x08, 0x61, 0xd8, 0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61,
+    0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e, 0x52, 0xbc, 0x51, 0x4d,
+    0x16, 0xcc, 0xf8, 0x06, 0x81, 0x8c, 0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36,
+    0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6, 0xb4, 0x0b, 0x8e, 0xed,
+    0xf2, 0x78, 0x5e, 0x42, 0x87, 0x4d
+};
+
+/* RFC 7914 section 11: P "Password", S "NaCl", c 80000, dkLen 64 */
+static const unsigned char pbkdf2_expected[64] = {
+    0x4d, 0xdc, 0xd8, 0xf6, 0x0b, 0x98, 0xbe, 0x21, 0x83, 0x0c, 0xee, 0x5e,
+    0xf2, 0x27, 0x01, 0xf9, 0x64, 0x1a, 0x44, 0x18, 0xd0, 0x4c, 0x04, 0x14,
+    0xae, 0xff, 0x08, 0x87, 0x6b, 0x34, 0xab, 0x56, 0xa1, 0xd4, 0x25, 0xa1,
+    0x22, 0x58, 0x33, 0x54, 0x9a, 0xdb, 0x84, 0x1b, 0x51, 0xc9, 0xb3, 0x17,
+    0x6a, 0x27, 0x2b, 0xde, 0xbb, 0xa1, 0xd0, 0x78, 0x47, 0x8f, 0x62, 0xb3,
+    0x97, 0xf3, 0x3c, 0x8d
+};
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Encrypt frame_size-byte frames for about BENCH_SECONDS; returns GB/s */
+static double measure(const struct CipherKey* key, int version, char* buffer, unsigned long frame_size)
+{
+    unsigned char nonce[CHACHA_NONCE_SIZE];
+    double start = now_seconds();
+    double elapsed;
+    double bytes = 0;
+    int i;
+
+    next_frame_nonce(nonce);
+    do {
+        for (i = 0; i < 256; i++) {
+            crypt_frame_payload(key, version, nonce, buffer, frame_size);
+        }
+        bytes += 256.0 * frame_size;
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    return bytes / elapsed / 1e9;
+}
+
+/* Encrypt the RFC 8439 test vector with a kernel */
+static int check_chacha_vector(const char* name)
+{
+    unsigned int words[CHACHA_KEY_WORDS];
+    char data[sizeof(chacha_ciphertext)];
+    int i;
+
+    for (i = 0; i < CHACHA_KEY_WORDS; i++) {
+        words[i] = (unsigned int)(i * 4) | ((unsigned int)(i * 4 + 1) << 8) |
+                   ((unsigned int)(i * 4 + 2) << 16) | ((unsigned int)(i * 4 + 3) << 24);
+    }
+    memcpy(data, chacha_plaintext, sizeof(data));
+    chacha20_xor(words, chacha_nonce, 1, data, sizeof(data));
+
+    if (memcmp(data, chacha_ciphertext, sizeof(data)) != 0) {
+        fprintf(stderr, "Error: %s kernel fails the RFC 8439 test vector\n", name);
+        return 0;
+    }
+    return 1;
+}
+
+static int check_pbkdf2_vector(void)
+{
+    unsigned char output[sizeof(pbkdf2_expected)];
+
+    pbkdf2_hmac_sha256((const unsigned char*)"Password", 8, (const unsigned char*)"NaCl", 4,
+                       80000, output, sizeof(output));
+    if (memcmp(output, pbkdf2_expected, sizeof(output)) != 0) {
+        fprintf(stderr, "Error: PBKDF2-HMAC-SHA-256 fails the RFC 7914 test vector\n");
+        return 0;
+    }
+    return 1;
+}
+
+/* Compare a kernel with the scalar path over every length up to a few
+ * wide blocks and one full-size frame */
+static int check_kernel(const struct CipherKey* key, const char* name, char* expected, char* actual)
+{
+    unsigned char nonce[CHACHA_NONCE_SIZE];
+    unsigned long length;
+    unsigned long i;
+
+    next_frame_nonce(nonce);
+    for (length = 0; length <= BENCH_BUFFER_SIZE; length = (length < 1100) ? length + 1 : BENCH_BUFFER_SIZE + 1) {
+        unsigned long size = (length > BENCH_BUFFER_SIZE) ? BENCH_BUFFER_SIZE : length;
+
+        for (i = 0; i < size; i++) {
+            expected[i] = actual[i] = (char)(i * 7);
+        }
+        chacha20_use_kernel("scalar");
+        chacha20_xor(key->words, nonce, 1, expected, size);
+        chacha20_use_kernel(name);
+        chacha20_xor(key->words, nonce, 1, actual, size);
+
+        if (memcmp(expected, actual, size) != 0) {
+            fprintf(stderr, "Error: %s kernel disagrees with scalar at length %lu\n", name, size);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned char salt[CIPHER_SALT_SIZE];
+    struct CipherKey key;
+    char* buffer = malloc(BENCH_BUFFER_SIZE);
+    char* expected = malloc(BENCH_BUFFER_SIZE);
+    int check_only = argc > 1 && strcmp(argv[1], "--check") == 0;
+    double start;
+    int failed = 0;
+    int i;
+
+    if (buffer == NULL || expected == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 1;
+    }
+    memset(buffer, 'x', BENCH_BUFFER_SIZE);
+
+    start = now_seconds();
+    if (!generate_cipher_salt(salt) || !derive_cipher_key("benchmark password", salt, &key)) {
+        return 1;
+    }
+    if (!check_only) {
+        printf("Key derivation (PBKDF2-HMAC-SHA-256, %d iterations): %.1f ms, once per session\n",
+               CIPHER_KDF_ITERATIONS, (now_seconds() - start) * 1000);
+        printf("Default kernel: %s\n\n", chacha20_kernel_name());
+        printf("%-8s %14s %14s\n", "kernel", "64 KiB frames", "256 B frames");
+    }
+    if (!check_pbkdf2_vector()) {
+        failed = 1;
+    }
+
+    for (i = 0; i < (int)(sizeof(kernels) / sizeof(kernels[0])); i++) {
+        if (!chacha20_use_kernel(kernels[i])) {
+            if (!check_only) {
+                printf("%-8s %14s %14s\n", kernels[i], "unsupported", "-");
+            }
+            continue;
+        }
+        if (!check_chacha_vector(kernels[i]) || !check_kernel(&key, kernels[i], expected, buffer)) {
+            failed = 1;
+            continue;
+        }
+        if (!check_only) {
+            printf("%-8s %10.2f GB/s %9.2f GB/s\n", kernels[i],
+                   measure(&key, CIPHER_VERSION, buffer, BENCH_BUFFER_SIZE),
+                   measure(&key, CIPHER_VERSION, buffer, 256));
+        }
+    }
+
+    if (check_only) {
+        printf("%s: cipher test vectors and kernels\n", failed ? "FAIL" : "PASS");
+    } else {
+        printf("%-8s %10.2f GB/s %9.2f GB/s  (legacy single-byte XOR)\n", "xor",
+               measure(&key, CIPHER_VERSION - 1, buffer, BENCH_BUFFER_SIZE),
+               measure(&key, CIPHER_VERSION - 1, buffer, 256));
+    }
+
+    wipe_cipher_key(&key);
+    free(buffer);
+    free(expected);
+    return failed;
+}
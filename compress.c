@@ -1,6 +1,7 @@
 #include "compress.h"
 
-/* RLE compression: [count][value] where count is number of consecutive identical bytes */
+/* RLE compression: [count][value] where count is number of consecutive identical bytes,
+ * stored as an unsigned byte from 1 to 255 */
 int compress_rle(const char* input, int input_length, char* output, int output_size)
 {
     int input_pos = 0;
@@ -19,7 +20,7 @@ int compress_rle(const char* input, int input_length, char* output, int output_s
 
         /* Always encode as [count][value] */
         if (output_pos + 2 > output_size) break;
-        output[output_pos++] = (char)run_length;
+        output[output_pos++] = (char)(unsigned char)run_length;
         output[output_pos++] = current_byte;
 
         input_pos += run_length;
@@ -34,10 +35,10 @@ int decompress_rle(const char* input, int input_length, char* output, int output
     int output_pos = 0;
 
     while (input_pos + 1 < input_length && output_pos < output_size) {
-        char count = input[input_pos++];
+        int count = (unsigned char)input[input_pos++];
         char value = input[input_pos++];
 
-        if (count <= 0) break; /* Safety check */
+        if (count == 0) break; /* Safety check */
 
         int remaining_space = output_size - output_pos;
         if (remaining_space < count) {
@@ -1,5 +1,135 @@
+#include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include "encrypt.h"
+#include "sha256.h"
+
+/* Nonces are a random 64-bit prefix drawn once per process followed by
+ * a 32-bit counter; when the counter wraps the prefix is incremented, so
+ * no nonce repeats within a process and collisions across processes need
+ * two equal random prefixes. */
+static pthread_mutex_t nonce_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char nonce_prefix[8];
+static unsigned long nonce_counter;
+static int nonce_seeded = 0;
+
+static int seed_nonces(void)
+{
+    int ok;
+
+    pthread_mutex_lock(&nonce_lock);
+    if (!nonce_seeded) {
+        FILE* random = fopen("/dev/urandom", "rb");
+        if (random != NULL) {
+            nonce_seeded = fread(nonce_prefix, 1, sizeof(nonce_prefix), random) == sizeof(nonce_prefix);
+            fclose(random);
+        }
+        nonce_counter = 0;
+    }
+    ok = nonce_seeded;
+    pthread_mutex_unlock(&nonce_lock);
+    return ok;
+}
+
+/* Fill salt with CIPHER_SALT_SIZE random bytes for a new archive or
+ * password. Returns 0 on error. */
+int generate_cipher_salt(unsigned char* salt)
+{
+    int ok = 0;
+    FILE* random = fopen("/dev/urandom", "rb");
+
+    if (random != NULL) {
+        ok = fread(salt, 1, CIPHER_SALT_SIZE, random) == CIPHER_SALT_SIZE;
+        fclose(random);
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Cannot read /dev/urandom for a key salt\n");
+    }
+    return ok;
+}
+
+/* Derive the session key for a password and salt; this is deliberately
+ * slow, so callers do it once and pass the key around. The key's check
+ * value is HMAC-SHA-256 of CIPHER_CHECK_LABEL keyed with the derived key
+ * (a single PBKDF2 iteration), truncated. Also seeds the nonce
+ * generator. Returns 0 on error. */
+int derive_cipher_key(const char* password, const unsigned char* salt, struct CipherKey* key)
+{
+    unsigned char bytes[CHACHA_KEY_WORDS * 4];
+    int i;
+
+    if (!seed_nonces()) {
+        fprintf(stderr, "Error: Cannot read /dev/urandom for frame nonces\n");
+        return 0;
+    }
+
+    pbkdf2_hmac_sha256((const unsigned char*)password, strlen(password), salt, CIPHER_SALT_SIZE,
+                       CIPHER_KDF_ITERATIONS, bytes, sizeof(bytes));
+    for (i = 0; i < CHACHA_KEY_WORDS; i++) {
+        key->words[i] = (unsigned int)bytes[i * 4] | ((unsigned int)bytes[i * 4 + 1] << 8) |
+                        ((unsigned int)bytes[i * 4 + 2] << 16) | ((unsigned int)bytes[i * 4 + 3] << 24);
+    }
+    key->legacy = password[0];
+    memcpy(key->salt, salt, CIPHER_SALT_SIZE);
+    pbkdf2_hmac_sha256(bytes, sizeof(bytes), (const unsigned char*)CIPHER_CHECK_LABEL,
+                       strlen(CIPHER_CHECK_LABEL), 1, key->check, CIPHER_CHECK_SIZE);
+
+    memset(bytes, 0, sizeof(bytes));
+    return 1;
+}
+
+/* True if check is the check value stored for this key. Compares every
+ * byte so the time taken does not depend on where they differ. */
+int cipher_key_matches(const struct CipherKey* key, const unsigned char* check)
+{
+    unsigned char difference = 0;
+    int i;
+
+    for (i = 0; i < CIPHER_CHECK_SIZE; i++) {
+        difference |= key->check[i] ^ check[i];
+    }
+    return difference == 0;
+}
+
+void wipe_cipher_key(struct CipherKey* key)
+{
+    memset(key, 0, sizeof(struct CipherKey));
+}
+
+/* Fill nonce with CHACHA_NONCE_SIZE bytes never handed out before in
+ * this process. derive_cipher_key must have been called first. */
+void next_frame_nonce(unsigned char* nonce)
+{
+    int i;
+
+    pthread_mutex_lock(&nonce_lock);
+    memcpy(nonce, nonce_prefix, sizeof(nonce_prefix));
+    nonce[8] = (unsigned char)nonce_counter;
+    nonce[9] = (unsigned char)(nonce_counter >> 8);
+    nonce[10] = (unsigned char)(nonce_counter >> 16);
+    nonce[11] = (unsigned char)(nonce_counter >> 24);
+
+    nonce_counter = (nonce_counter + 1) & 0xffffffffUL;
+    if (nonce_counter == 0) {
+        for (i = 0; i < 8 && ++nonce_prefix[i] == 0; i++) {
+            /* carry into the next byte */
+        }
+    }
+    pthread_mutex_unlock(&nonce_lock);
+}
+
+/* Encrypt or decrypt one frame payload in place with the cipher of the
+ * given format version */
+void crypt_frame_payload(const struct CipherKey* key, int version, const unsigned char* nonce,
+                         char* data, unsigned long length)
+{
+    if (version >= CIPHER_VERSION) {
+        chacha20_xor(key->words, nonce, 0, data, length);
+    } else {
+        xor_encrypt(data, (int)length, key->legacy);
+    }
+}
+
 
 void xor_encrypt(char* data, int length, char key)
 {
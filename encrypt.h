@@ -1,6 +1,35 @@
 #ifndef ENCRYPT_H
 #define ENCRYPT_H
 
+#include "chacha.h"
+
+/* Frames from version 5 on are encrypted with ChaCha20 under a key
+ * derived from the whole password and a random per-archive salt with
+ * PBKDF2-HMAC-SHA-256. Archives store the salt next to a key check
+ * value, so a wrong password is caught before anything is decrypted.
+ * Older frames used a single-byte XOR with the password's first
+ * character. */
+#define CIPHER_VERSION 5
+#define CIPHER_KDF_ITERATIONS 100000
+#define CIPHER_SALT_SIZE 16
+#define CIPHER_CHECK_SIZE 16
+#define CIPHER_CHECK_LABEL "medical-archiver key check"
+
+/* Session key, derived once per password and shared by every thread */
+struct CipherKey {
+    unsigned int words[CHACHA_KEY_WORDS];
+    char legacy;            /* XOR key for frames older than CIPHER_VERSION */
+    unsigned char salt[CIPHER_SALT_SIZE];    /* salt the key was derived from */
+    unsigned char check[CIPHER_CHECK_SIZE];  /* HMAC of CIPHER_CHECK_LABEL under the key */
+};
+
+int generate_cipher_salt(unsigned char* salt);
+int derive_cipher_key(const char* password, const unsigned char* salt, struct CipherKey* key);
+int cipher_key_matches(const struct CipherKey* key, const unsigned char* check);
+void wipe_cipher_key(struct CipherKey* key);
+void next_frame_nonce(unsigned char* nonce);
+void crypt_frame_payload(const struct CipherKey* key, int version, const unsigned char* nonce,
+                         char* data, unsigned long length);
 
 void xor_encrypt(char* data, int length, char key);
 void xor_decrypt(char* data, int length, char key);
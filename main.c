@@ -1,9 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "record.h"
-#include "encrypt.h"
-#include "compress.h"
+#include <unistd.h>
+#include "archive.h"
 
 #define MAX_RECORD_SIZE 65536 
 #define MAX_PASSWORD_LENGTH 256
@@ -18,12 +17,25 @@ void do_view(void);
 void do_search(const char* term);
 void do_sort(void);
 void do_delete(const char* target);
-void initialize_archive(void);
+int do_verify(void);
+void do_export(const char* filename);
+int do_create_shards(const char* count);
+int do_rekey(const char* new_password);
+int do_backup(const char* since);
+int do_restore(const char* filename);
+int initialize_archive(void);
+int parse_time(const char* text, time_t* result);
 
 /* Global variables */
 char* current_command = NULL;
 char* current_term = NULL;
 char* archive_password = NULL;
+char* archive_path = DEFAULT_ARCHIVE_FILE;
+char* password_arg = NULL;
+char* since_arg = NULL;
+char* until_arg = NULL;
+struct RecordFilter time_filter;
+struct Archive* archive = NULL;
 
 /* Main function */
 int main(int argc, char* argv[])
@@ -35,8 +47,23 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    if (strcmp(current_command, "shards") == 0) {
+        if (current_term == NULL) {
+            fprintf(stderr, "Error: shards command requires a shard count\n");
+            return 1;
+        }
+        return do_create_shards(current_term) ? 0 : 1;
+    }
+
     /* Initialize archive and get password */
-    initialize_archive();
+    if (!initialize_archive()) {
+        return 1;
+    }
+
+    if ((since_arg != NULL && !parse_time(since_arg, &time_filter.since)) ||
+        (until_arg != NULL && !parse_time(until_arg, &time_filter.until))) {
+        return 1;
+    }
 
     if (strcmp(current_command, "add") == 0) {
         do_add();
@@ -56,6 +83,40 @@ int main(int argc, char* argv[])
             return 1;
         }
         do_delete(current_term);
+    } else if (strcmp(current_command, "verify") == 0) {
+        if (!do_verify()) {
+            return 1;
+        }
+    } else if (strcmp(current_command, "export") == 0) {
+        if (current_term == NULL) {
+            fprintf(stderr, "Error: export command requires an output file\n");
+            return 1;
+        }
+        do_export(current_term);
+    } else if (strcmp(current_command, "rekey") == 0) {
+        if (current_term == NULL) {
+            fprintf(stderr, "Error: rekey command requires a new password\n");
+            return 1;
+        }
+        if (!do_rekey(current_term)) {
+            return 1;
+        }
+    } else if (strcmp(current_command, "backup") == 0) {
+        if (current_term == NULL) {
+            fprintf(stderr, "Error: backup command requires a generation number\n");
+            return 1;
+        }
+        if (!do_backup(current_term)) {
+            return 1;
+        }
+    } else if (strcmp(current_command, "restore") == 0) {
+        if (current_term == NULL) {
+            fprintf(stderr, "Error: restore command requires a backup file\n");
+            return 1;
+        }
+        if (!do_restore(current_term)) {
+            return 1;
+        }
     } else if (strcmp(current_command, "help") == 0) {
         display_help(argv[0]);
     } else {
@@ -64,6 +125,8 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    archive_close(archive);
+
     /* Free the password if it was prompted */
     if (archive_password != NULL && strcmp(archive_password, DEFAULT_PASSWORD) != 0) {
         free(archive_password);
@@ -94,6 +157,49 @@ void parse_arguments(int argc, char* argv[])
             if (i + 1 < argc) {
                 current_term = argv[++i];
             }
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            current_command = "verify";
+        } else if (strcmp(argv[i], "--export") == 0) {
+            current_command = "export";
+            if (i + 1 < argc) {
+                current_term = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--shards") == 0) {
+            current_command = "shards";
+            if (i + 1 < argc) {
+                current_term = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--rekey") == 0) {
+            current_command = "rekey";
+            if (i + 1 < argc) {
+                current_term = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--backup-since") == 0) {
+            current_command = "backup";
+            if (i + 1 < argc) {
+                current_term = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--restore") == 0) {
+            current_command = "restore";
+            if (i + 1 < argc) {
+                current_term = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--password") == 0) {
+            if (i + 1 < argc) {
+                password_arg = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--archive") == 0) {
+            if (i + 1 < argc) {
+                archive_path = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--since") == 0) {
+            if (i + 1 < argc) {
+                since_arg = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--until") == 0) {
+            if (i + 1 < argc) {
+                until_arg = argv[++i];
+            }
         } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
             current_command = "help";
         } else {
@@ -106,45 +212,126 @@ void parse_arguments(int argc, char* argv[])
 void display_help(const char* program_name)
 {
     printf("Medical Record Archiver\n");
-    printf("Usage: %s [MODE]\n", program_name);
+    printf("Usage: %s [--archive <path>] [MODE]\n", program_name);
     printf("\nModes:\n");
     printf("  --add     Add a new patient record\n");
     printf("  --view    View all patient records\n");
     printf("  --search <term>  Search records by term\n");
     printf("  --delete <id>    Delete record by ID or search term\n");
     printf("  --sort    Sort records by name\n");
+    printf("  --verify  Check every stored record decodes\n");
+    printf("  --export <file>  Write all records as plain text ('-' for stdout)\n");
+    printf("  --shards <n>     Create a sharded archive directory with n shards\n");
+    printf("  --rekey <new>    Re-encrypt the archive under a new password\n");
+    printf("  --backup-since <gen>  Write changes from generation gen on to stdout\n");
+    printf("  --restore <file>      Apply a backup stream ('-' for stdin)\n");
     printf("  --help    Show this help message\n");
+    printf("\nOptions:\n");
+    printf("  --archive <path> Archive file or shard directory (default %s)\n", DEFAULT_ARCHIVE_FILE);
+    printf("  --password <pw>  Archive password (default password if omitted)\n");
+    printf("  --since <time>   Only records modified at or after time\n");
+    printf("  --until <time>   Only records modified at or before time\n");
+    printf("                   (time is YYYY-MM-DD, \"YYYY-MM-DD HH:MM:SS\" or Unix seconds)\n");
 }
 
 /* Initialize archive and get password */
-void initialize_archive(void)
+int initialize_archive(void)
 {
-    /* Try to use default password first */
-    archive_password = DEFAULT_PASSWORD;
+    /* Use the given password, falling back to the default one */
+    if (password_arg != NULL) {
+        archive_password = strdup(password_arg);
+        if (archive_password == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed for password\n");
+            return 0;
+        }
+    } else {
+        archive_password = DEFAULT_PASSWORD;
+    }
 
-    /* If no archive exists, create one */
-    struct Record* temp_head = NULL;
-    if (load_records(DEFAULT_ARCHIVE_FILE, archive_password, &temp_head) == 0) {
-        /* No existing archive, create one */
-        save_records(DEFAULT_ARCHIVE_FILE, archive_password, temp_head);
+    archive = archive_open(archive_path, archive_password);
+    return archive != NULL;
+}
+
+/* Parse a --since/--until argument as local date/time or Unix seconds */
+int parse_time(const char* text, time_t* result)
+{
+    struct tm parts;
+    char* endptr;
+    char extra;
+    unsigned long seconds = strtoul(text, &endptr, 10);
+
+    if (*text != '\0' && *endptr == '\0') {
+        *result = (time_t)seconds;
+        return 1;
     }
-    free_records(temp_head);
+
+    memset(&parts, 0, sizeof(parts));
+    if (sscanf(text, "%d-%d-%d%c", &parts.tm_year, &parts.tm_mon, &parts.tm_mday, &extra) != 3 &&
+        sscanf(text, "%d-%d-%d %d:%d:%d%c", &parts.tm_year, &parts.tm_mon, &parts.tm_mday,
+               &parts.tm_hour, &parts.tm_min, &parts.tm_sec, &extra) != 6) {
+        fprintf(stderr, "Error: Invalid time '%s'\n", text);
+        return 0;
+    }
+
+    parts.tm_year -= 1900;
+    parts.tm_mon -= 1;
+    parts.tm_isdst = -1;
+    *result = mktime(&parts);
+    if (*result == (time_t)-1) {
+        fprintf(stderr, "Error: Invalid time '%s'\n", text);
+        return 0;
+    }
+    return 1;
 }
 
-/* Add a new record */
-void do_add(void)
+/* Format a record timestamp as local "YYYY-MM-DD HH:MM:SS" */
+static void format_record_time(time_t when, char* buffer, int size)
+{
+    struct tm* local = localtime(&when);
+    if (local == NULL || strftime(buffer, size, "%Y-%m-%d %H:%M:%S", local) == 0) {
+        sprintf(buffer, "%ld", (long)when);
+    }
+}
+
+/* Print all records in the list */
+static void print_records(const struct Record* head)
+{
+    const struct Record* current = head;
+    while (current != NULL) {
+        printf("ID: %u\n", current->id);
+        printf("Data: %s\n", current->data);
+        if (current->modified != 0) {
+            char created[32];
+            char modified[32];
+            format_record_time(current->created, created, sizeof(created));
+            format_record_time(current->modified, modified, sizeof(modified));
+            printf("Created: %s  Modified: %s\n", created, modified);
+        }
+        printf("--------------------\n");
+        current = current->next;
+    }
+}
+
+/* Load the archive as one list ordered by ID, honouring any
+ * --since/--until bounds */
+static struct Record* load_archive(const char* term, int* loaded)
 {
     struct Record* head = NULL;
+    struct RecordFilter filter = time_filter;
 
-    /* Load existing records */
-    load_records(DEFAULT_ARCHIVE_FILE, archive_password, &head);
+    filter.term = term;
+    *loaded = archive_load(archive, &filter, &head);
+    return head;
+}
 
+/* Add a new record */
+void do_add(void)
+{
     /* Get record data from user */
     char data[MAX_RECORD_SIZE];
     printf("Enter record data (format: name:John Doe;age:45;diagnosis:Flu;notes:Recovered):\n");
     if (fgets(data, sizeof(data), stdin) == NULL) {
         fprintf(stderr, "Error: Failed to read input\n");
-        free_records(head);
         return;
     }
 
@@ -154,35 +341,9 @@ void do_add(void)
         data[len-1] = '\0';
     }
 
-    /* Create new record */
-    struct Record* new_record = create_record(0, data);
-
-    if (new_record == NULL) {
-        fprintf(stderr, "Error: Failed to create record\n");
-        free_records(head);
-        return;
-    }
-
-    /* Assign ID (find max existing ID + 1) */
-    struct Record* current = head;
-    unsigned int max_id = 0;
-    while (current != NULL) {
-        if (current->id > max_id) {
-            max_id = current->id;
-        }
-        current = current->next;
-    }
-    new_record->id = max_id + 1;
-
-    /* Add to list */
-    add_record(&head, new_record);
-
-    /* Save all records */
-    int saved = save_records(DEFAULT_ARCHIVE_FILE, archive_password, head);
-    free_records(head);
-
-    if (saved > 0) {
-        printf("Record added successfully (ID: %u).\n", new_record->id);
+    unsigned int id = archive_put(archive, data);
+    if (id != 0) {
+        printf("Record added successfully (ID: %u).\n", id);
     } else {
         printf("Error: Failed to save record.\n");
     }
@@ -191,9 +352,8 @@ void do_add(void)
 /* View all records */
 void do_view(void)
 {
-    struct Record* head = NULL;
-
-    int loaded = load_records(DEFAULT_ARCHIVE_FILE, archive_password, &head);
+    int loaded;
+    struct Record* head = load_archive(NULL, &loaded);
 
     if (loaded == 0) {
         printf("No patient records found.\n");
@@ -202,17 +362,14 @@ void do_view(void)
         print_records(head);
     }
 
-    free_records(head);
+    archive_free_records(head);
 }
 
 /* Search records by term */
 void do_search(const char* term)
 {
-    struct Record* head = NULL;
-
-    load_records(DEFAULT_ARCHIVE_FILE, archive_password, &head);
-
-    struct Record* results = search_records(head, term);
+    int found;
+    struct Record* results = load_archive(term, &found);
 
     if (results == NULL) {
         printf("No records found matching '%s'.\n", term);
@@ -221,16 +378,14 @@ void do_search(const char* term)
         print_records(results);
     }
 
-    free_records(head);
-    free_records(results);
+    archive_free_records(results);
 }
 
 /* Sort records by name */
 void do_sort(void)
 {
-    struct Record* head = NULL;
-
-    load_records(DEFAULT_ARCHIVE_FILE, archive_password, &head);
+    int loaded;
+    struct Record* head = load_archive(NULL, &loaded);
 
     if (head == NULL) {
         printf("No records to sort.\n");
@@ -248,10 +403,14 @@ void do_sort(void)
 
         while (current->next != last) {
             if (strcmp(current->data, current->next->data) > 0) {
-                /* Swap data */
-                char* temp_data = current->data;
-                current->data = current->next->data;
-                current->next->data = temp_data;
+                /* Swap the record contents, keeping the links in place */
+                struct Record temp = *current;
+                struct Record* next = current->next;
+
+                *current = *next;
+                current->next = next;
+                temp.next = next->next;
+                *next = temp;
 
                 swapped = 1;
             }
@@ -263,107 +422,221 @@ void do_sort(void)
     printf("Records sorted by name:\n");
     print_records(head);
 
-    free_records(head);
+    archive_free_records(head);
 }
 
 /* Delete records by ID or search term */
 void do_delete(const char* target)
 {
-    struct Record* head = NULL;
-
-    /* Load existing records */
-    load_records(DEFAULT_ARCHIVE_FILE, archive_password, &head);
-
-    if (head == NULL) {
-        printf("No records to delete.\n");
-        return;
-    }
+    char data[MAX_RECORD_SIZE];
+    struct RecordFilter filter;
+    struct Record* matches = NULL;
+    struct Record* current;
+    unsigned int* ids;
+    int count = 0;
+    int deleted;
 
     /* Check if target is a number (ID) or text (search term) */
     char* endptr;
     unsigned int delete_id = (unsigned int)strtoul(target, &endptr, 10);
 
     if (*endptr == '\0') {
-        /* Target is a number - delete by ID */
-        struct Record* record_to_delete = find_record(head, delete_id);
-        if (record_to_delete == NULL) {
+        if (archive_get(archive, delete_id, data, sizeof(data)) < 0) {
             printf("No record found with ID %u.\n", delete_id);
-            free_records(head);
             return;
         }
-
-        /* Remove the record from the linked list */
-        struct Record* current = head;
-        struct Record* previous = NULL;
-
-        while (current != NULL) {
-            if (current->id == delete_id) {
-                if (previous == NULL) {
-                    /* Delete head */
-                    head = current->next;
-                } else {
-                    /* Delete middle/end */
-                    previous->next = current->next;
-                }
-
-                printf("Deleted record ID %u: %s\n", current->id, current->data);
-                free(current->data);
-                free(current);
-                break;
-            }
-            previous = current;
-            current = current->next;
+        deleted = archive_delete(archive, &delete_id, 1);
+        if (deleted > 0) {
+            printf("Deleted record ID %u: %s\n", delete_id, data);
         }
     } else {
-        /* Target is text - delete all matching records */
-        struct Record* results = search_records(head, target);
-        if (results == NULL) {
+        memset(&filter, 0, sizeof(filter));
+        filter.term = target;
+        archive_load(archive, &filter, &matches);
+
+        for (current = matches; current != NULL; current = current->next) {
+            count++;
+        }
+        if (count == 0) {
             printf("No records found matching '%s'.\n", target);
-            free_records(head);
             return;
         }
 
-        printf("Found %d record(s) matching '%s'. Deleting:\n", 1, target); /* Simplified count */
-
-        /* Delete matching records */
-        struct Record* current = results;
-        while (current != NULL) {
-            struct Record* record_to_delete = find_record(head, current->id);
-            if (record_to_delete != NULL) {
-                /* Remove from main list */
-                struct Record* temp = head;
-                struct Record* prev = NULL;
-
-                while (temp != NULL) {
-                    if (temp->id == record_to_delete->id) {
-                        if (prev == NULL) {
-                            head = temp->next;
-                        } else {
-                            prev->next = temp->next;
-                        }
-
-                        printf("  - ID %u: %s\n", temp->id, temp->data);
-                        free(temp->data);
-                        free(temp);
-                        break;
-                    }
-                    prev = temp;
-                    temp = temp->next;
-                }
-            }
-            current = current->next;
+        ids = (unsigned int*)malloc(count * sizeof(unsigned int));
+        if (ids == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            archive_free_records(matches);
+            return;
         }
 
-        free_records(results);
-    }
+        printf("Found %d record(s) matching '%s'. Deleting:\n", count, target);
+        count = 0;
+        for (current = matches; current != NULL; current = current->next) {
+            printf("  - ID %u: %s\n", current->id, current->data);
+            ids[count++] = current->id;
+        }
+        archive_free_records(matches);
 
-    /* Save the updated list */
-    int saved = save_records(DEFAULT_ARCHIVE_FILE, archive_password, head);
-    free_records(head);
+        deleted = archive_delete(archive, ids, count);
+        free(ids);
+    }
 
-    if (saved > 0) {
+    if (deleted >= 0) {
         printf("Records deleted and archive updated.\n");
     } else {
         printf("Error: Failed to save updated archive.\n");
     }
 }
+
+/* Verify every frame in every shard decodes; returns 0 on corruption */
+int do_verify(void)
+{
+    int shard_count = archive_shard_count(archive);
+    int* frames = (int*)malloc(shard_count * sizeof(int));
+    int* bad_frames = (int*)malloc(shard_count * sizeof(int));
+    int total_frames = 0;
+    int total_bad = -1;
+    int shard;
+
+    if (frames != NULL && bad_frames != NULL) {
+        total_bad = archive_verify(archive, frames, bad_frames);
+    }
+    if (total_bad < 0) {
+        free(frames);
+        free(bad_frames);
+        return 0;
+    }
+
+    for (shard = 0; shard < shard_count; shard++) {
+        if (archive_is_sharded(archive)) {
+            printf("Shard %d: %d record(s), %d corrupt\n", shard, frames[shard], bad_frames[shard]);
+        }
+        total_frames += frames[shard];
+    }
+    free(frames);
+    free(bad_frames);
+
+    printf("Verified %d record(s): %d corrupt.\n", total_frames, total_bad);
+    return total_bad == 0;
+}
+
+/* Export all records as "id<TAB>data" lines */
+void do_export(const char* filename)
+{
+    int loaded;
+    int to_stdout = strcmp(filename, "-") == 0;
+    FILE* output = to_stdout ? stdout : fopen(filename, "w");
+
+    if (output == NULL) {
+        fprintf(stderr, "Error: Cannot create export file '%s'\n", filename);
+        return;
+    }
+
+    struct Record* head = load_archive(NULL, &loaded);
+    struct Record* current;
+    int ok = 1;
+
+    for (current = head; current != NULL; current = current->next) {
+        if (fprintf(output, "%u\t%s\n", current->id, current->data) < 0) {
+            ok = 0;
+            break;
+        }
+    }
+    archive_free_records(head);
+
+    if (!to_stdout && fclose(output) != 0) {
+        ok = 0;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Error: Failed to write export file '%s'\n", filename);
+    } else if (!to_stdout) {
+        printf("Exported %d record(s) to %s.\n", loaded, filename);
+    }
+}
+
+/* Create a new sharded archive directory */
+int do_create_shards(const char* count)
+{
+    char* endptr;
+    long shard_count = strtol(count, &endptr, 10);
+
+    if (*endptr != '\0') {
+        fprintf(stderr, "Error: Invalid shard count '%s'\n", count);
+        return 0;
+    }
+
+    if (!archive_create_sharded(archive_path, (int)shard_count)) {
+        return 0;
+    }
+    printf("Created sharded archive '%s' with %d shard(s).\n", archive_path, (int)shard_count);
+    return 1;
+}
+
+/* Re-encrypt the whole archive under a new password */
+int do_rekey(const char* new_password)
+{
+    int frames = archive_rekey(archive, new_password);
+    if (frames == ARCHIVE_REKEY_PARTIAL) {
+        printf("Error: Re-key failed part way; see above for which shards use which password.\n");
+        return 0;
+    }
+    if (frames < 0) {
+        printf("Error: Failed to re-key archive; it is unchanged.\n");
+        return 0;
+    }
+
+    printf("Re-keyed %d frame(s).\n", frames);
+    return 1;
+}
+
+/* Stream frames written at or after a generation to standard output */
+int do_backup(const char* since)
+{
+    char* endptr;
+    unsigned long long generation = strtoull(since, &endptr, 10);
+    unsigned long long next_generation;
+
+    if (*since == '\0' || *endptr != '\0') {
+        fprintf(stderr, "Error: Invalid generation '%s'\n", since);
+        return 0;
+    }
+    if (isatty(fileno(stdout))) {
+        fprintf(stderr, "Error: Refusing to write a backup stream to a terminal\n");
+        return 0;
+    }
+
+    int frames = archive_backup(archive, generation, stdout, &next_generation);
+    if (frames < 0) {
+        fprintf(stderr, "Error: Backup failed.\n");
+        return 0;
+    }
+
+    fprintf(stderr, "Backed up %d change(s). Next incremental backup: --backup-since %llu\n",
+            frames, next_generation);
+    return 1;
+}
+
+/* Apply a backup stream from a file, or standard input for "-" */
+int do_restore(const char* filename)
+{
+    int from_stdin = strcmp(filename, "-") == 0;
+    FILE* input = from_stdin ? stdin : fopen(filename, "rb");
+
+    if (input == NULL) {
+        fprintf(stderr, "Error: Cannot open backup file '%s'\n", filename);
+        return 0;
+    }
+
+    int applied = archive_restore(archive, input);
+    if (!from_stdin) {
+        fclose(input);
+    }
+
+    if (applied < 0) {
+        printf("Error: Restore failed.\n");
+        return 0;
+    }
+    printf("Restored %d change(s).\n", applied);
+    return 1;
+}
@@ -6,6 +6,11 @@
 #include "record.h"
 #include "encrypt.h"
 #include "compress.h"
+#include "timeindex.h"
+
+/* Fewest run lengths in an older-format file that archive_file_decodes
+ * judges a key by */
+#define LEGACY_KEY_MIN_RUNS 16
 
 /* Create a new record */
 struct Record* create_record(unsigned int id, const char* data)
@@ -24,11 +29,26 @@ struct Record* create_record(unsigned int id, const char* data)
         free(new_record);
         return NULL;
     }
+    new_record->created = time(NULL);
+    new_record->modified = new_record->created;
+    new_record->generation = 0;
     new_record->next = NULL;
 
     return new_record;
 }
 
+/* Create a standalone copy of a record, keeping its timestamps */
+struct Record* copy_record(const struct Record* record)
+{
+    struct Record* copy = create_record(record->id, record->data);
+    if (copy != NULL) {
+        copy->created = record->created;
+        copy->modified = record->modified;
+        copy->generation = record->generation;
+    }
+    return copy;
+}
+
 /* Add a record to the linked list */
 void add_record(struct Record** head, struct Record* new_record)
 {
@@ -43,18 +63,6 @@ void add_record(struct Record** head, struct Record* new_record)
     }
 }
 
-/* Print all records in the list */
-void print_records(const struct Record* head)
-{
-    const struct Record* current = head;
-    while (current != NULL) {
-        printf("ID: %u\n", current->id);
-        printf("Data: %s\n", current->data);
-        printf("--------------------\n");
-        current = current->next;
-    }
-}
-
 /* Free all records in the list */
 void free_records(struct Record* head)
 {
@@ -82,109 +90,499 @@ struct Record* find_record(struct Record* head, unsigned int id)
     return NULL;
 }
 
-/* Load records from archive file */
-int load_records(const char* filename, const char* password, struct Record** head)
+/* Parse the "ARCHVn\n" file header and return the format version, 0 if
+ * invalid. From CIPHER_VERSION on the header goes on with the archive's
+ * key salt and check value, copied to salt and check unless NULL. */
+int read_archive_keyed_header(FILE* file, unsigned char* salt, unsigned char* check)
 {
-    FILE* file = fopen(filename, "rb");
-    if (file == NULL) {
-        return 0; /* No file exists yet */
-    }
-
+    unsigned char keying[CIPHER_SALT_SIZE + CIPHER_CHECK_SIZE];
     char header[8];
+    int version;
+
     if (fread(header, 1, 7, file) != 7) {
-        fclose(file);
         return 0;
     }
     header[7] = '\0';
 
-    /* Check if header matches "ARCHV1" followed by newline */
-    if (strncmp(header, "ARCHV1", 6) != 0) {
-        fclose(file);
-        fprintf(stderr, "Error: Invalid archive format\n");
+    if (strncmp(header, "ARCHV", 5) != 0 || header[6] != '\n' ||
+        header[5] < '1' || header[5] > '0' + ARCHIVE_VERSION) {
         return 0;
     }
+    version = header[5] - '0';
 
-    /* Skip newline if present */
-    if (header[6] == '\n') {
-        /* Already consumed the newline */
-    } else {
-        fgetc(file); /* Skip newline */
+    if (version >= CIPHER_VERSION) {
+        if (fread(keying, 1, sizeof(keying), file) != sizeof(keying)) {
+            return 0;
+        }
+        if (salt != NULL) {
+            memcpy(salt, keying, CIPHER_SALT_SIZE);
+        }
+        if (check != NULL) {
+            memcpy(check, keying + CIPHER_SALT_SIZE, CIPHER_CHECK_SIZE);
+        }
     }
+    return version;
+}
+
+int read_archive_header(FILE* file)
+{
+    return read_archive_keyed_header(file, NULL, NULL);
+}
+
+/* Write the current file header, recording key's salt and check value */
+int write_archive_header(FILE* file, const struct CipherKey* key)
+{
+    char header[8];
+    sprintf(header, "ARCHV%d\n", ARCHIVE_VERSION);
+    return fwrite(header, 1, 7, file) == 7 &&
+           fwrite(key->salt, 1, CIPHER_SALT_SIZE, file) == CIPHER_SALT_SIZE &&
+           fwrite(key->check, 1, CIPHER_CHECK_SIZE, file) == CIPHER_CHECK_SIZE;
+}
 
-    unsigned int next_id = 1;
-    int records_loaded = 0;
+/* True if an archive header's salt and check value are key's */
+int archive_key_matches(const struct CipherKey* key, const unsigned char* salt, const unsigned char* check)
+{
+    return memcmp(key->salt, salt, CIPHER_SALT_SIZE) == 0 && cipher_key_matches(key, check);
+}
 
-    while (!feof(file)) {
-        unsigned char length_bytes[4];
-        unsigned char timestamp_bytes[8];
+/* Parse filename's file header like read_archive_header, but refuse a
+ * file keyed under anything but key, as a handle opened before another
+ * one re-keyed the archive would be. Returns the version, 0 if the
+ * header is invalid or -1, with an error, if the key does not match. */
+int read_archive_header_for_key(FILE* file, const char* filename, const struct CipherKey* key)
+{
+    unsigned char salt[CIPHER_SALT_SIZE];
+    unsigned char check[CIPHER_CHECK_SIZE];
+    int version = read_archive_keyed_header(file, salt, check);
 
-        if (fread(length_bytes, 1, 4, file) != 4) break;
-        if (fread(timestamp_bytes, 1, 8, file) != 8) break;
+    if (version >= CIPHER_VERSION && !archive_key_matches(key, salt, check)) {
+        fprintf(stderr, "Error: '%s' is encrypted under a different key\n", filename);
+        return -1;
+    }
+    return version;
+}
 
-        unsigned long record_length = read_u32_le(length_bytes);
+/* Size in bytes of the cleartext frame header for a format version */
+int frame_header_size(int version)
+{
+    if (version >= 5) return 44;
+    if (version == 4) return 32;
+    if (version == 3) return 24;
+    if (version == 2) return 16;
+    return 12;
+}
 
-        if (record_length == 0 || record_length > 65536) { 
-            break;
+/* Check a frame's payload length. Zero-length frames are delete markers,
+ * which only exist from version 4 on. */
+int frame_length_valid(int version, const struct FrameHeader* frame)
+{
+    if (frame->length == 0) {
+        return version >= 4;
+    }
+    return frame->length <= MAX_FRAME_SIZE;
+}
+
+/* Decode a frame header laid out for the given version:
+ *   v1: length(4) timestamp(8, unused)
+ *   v2: length(4) timestamp(8, unused) id(4)
+ *   v3: length(4) created(8) modified(8) id(4)
+ *   v4: length(4) created(8) modified(8) id(4) generation(8)
+ *   v5: length(4) created(8) modified(8) id(4) generation(8) nonce(12)
+ * Version 1 frames carry no ID, so the caller's running position is used
+ * instead, and frames before version 3 have no usable timestamps. */
+static void decode_frame_header(const unsigned char* buffer, int version, unsigned int position,
+                                struct FrameHeader* frame)
+{
+    frame->length = read_u32_le(buffer);
+    frame->id = position;
+    frame->created = 0;
+    frame->modified = 0;
+    frame->generation = 0;
+    memset(frame->nonce, 0, CHACHA_NONCE_SIZE);
+
+    if (version == 2) {
+        frame->id = (unsigned int)read_u32_le(buffer + 12);
+    } else if (version >= 3) {
+        frame->created = (time_t)read_u64_le(buffer + 4);
+        frame->modified = (time_t)read_u64_le(buffer + 12);
+        frame->id = (unsigned int)read_u32_le(buffer + 20);
+    }
+    if (version >= 4) {
+        frame->generation = read_u64_le(buffer + 24);
+    }
+    if (version >= 5) {
+        memcpy(frame->nonce, buffer + 32, CHACHA_NONCE_SIZE);
+    }
+}
+
+/* Encode a frame header in the current format; returns its size */
+int encode_frame_header(unsigned char* buffer, const struct FrameHeader* frame)
+{
+    write_u32_le(buffer, frame->length);
+    write_u64_le(buffer + 4, (unsigned long long)frame->created);
+    write_u64_le(buffer + 12, (unsigned long long)frame->modified);
+    write_u32_le(buffer + 20, (unsigned long)frame->id);
+    write_u64_le(buffer + 24, frame->generation);
+    memcpy(buffer + 32, frame->nonce, CHACHA_NONCE_SIZE);
+    return frame_header_size(ARCHIVE_VERSION);
+}
+
+/* Read the next frame header. Returns 1 on success, 0 at end of file
+ * and -1 if the file ends partway through a header. */
+int read_frame_header(FILE* file, int version, unsigned int position, struct FrameHeader* frame)
+{
+    unsigned char buffer[MAX_FRAME_HEADER_SIZE];
+    int header_size = frame_header_size(version);
+
+    size_t got = fread(buffer, 1, header_size, file);
+    if (got == 0) return 0;
+    if (got != (size_t)header_size) return -1;
+
+    decode_frame_header(buffer, version, position, frame);
+    return 1;
+}
+
+/* Write a frame in the current format from a header and its already
+ * compressed and encrypted payload (NULL for a delete marker) */
+int write_raw_frame(FILE* file, const struct FrameHeader* frame, const char* payload)
+{
+    unsigned char buffer[MAX_FRAME_HEADER_SIZE];
+    int header_size = encode_frame_header(buffer, frame);
+
+    return fwrite(buffer, 1, header_size, file) == (size_t)header_size &&
+           (frame->length == 0 || fwrite(payload, 1, frame->length, file) == frame->length);
+}
+
+/* Re-encrypt the payload of a frame read from a file of the given
+ * version under from, to the current cipher under to with a fresh
+ * nonce, so it can be written by write_raw_frame */
+void reencrypt_frame_payload(const struct CipherKey* from, int version, const struct CipherKey* to,
+                             struct FrameHeader* frame, char* payload)
+{
+    if (frame->length == 0) {
+        return;
+    }
+    crypt_frame_payload(from, version, frame->nonce, payload, frame->length);
+    next_frame_nonce(frame->nonce);
+    crypt_frame_payload(to, ARCHIVE_VERSION, frame->nonce, payload, frame->length);
+}
+
+/* Bring a frame payload from a file of the given version up to the
+ * current cipher under the same key. Current-format frames are left
+ * alone. */
+void upgrade_frame_payload(const struct CipherKey* key, int version, struct FrameHeader* frame, char* payload)
+{
+    if (version < CIPHER_VERSION) {
+        reencrypt_frame_payload(key, version, key, frame, payload);
+    }
+}
+
+/* True if a decrypted payload is an RLE stream compress_rle could have
+ * written for record text: whole [count][value] pairs with counts from
+ * 1 to 255, no NUL values and at most MAX_FRAME_SIZE bytes in all */
+int payload_decodes(const char* payload, unsigned long length)
+{
+    const unsigned char* pair = (const unsigned char*)payload;
+    unsigned long decoded = 0;
+    unsigned long i;
+
+    if (length % 2 != 0) {
+        return 0;
+    }
+    for (i = 0; i < length; i += 2) {
+        if (pair[i] == 0 || pair[i + 1] == 0) {
+            return 0;
         }
+        decoded += pair[i];
+    }
+    return decoded <= MAX_FRAME_SIZE;
+}
 
-        char* compressed_data = malloc(record_length);
-        if (compressed_data == NULL) {
-            fclose(file);
-            return records_loaded;
+/* Decrypt and decompress one frame payload in place into output.
+ * Returns the decompressed length, or -1 if the frame is corrupt. */
+static int decode_frame(char* payload, const struct FrameHeader* frame, int version,
+                        const struct CipherKey* key, char* output)
+{
+    int decompressed_length;
+
+    crypt_frame_payload(key, version, frame->nonce, payload, frame->length);
+    decompressed_length = decompress_rle(payload, (int)frame->length, output, MAX_FRAME_SIZE);
+    if (decompressed_length <= 0) {
+        return -1;
+    }
+    output[decompressed_length] = '\0';
+    return decompressed_length;
+}
+
+/* Allocate scratch space for encoding or decoding one frame at a time */
+int init_frame_buffers(struct FrameBuffers* buffers)
+{
+    buffers->payload = (char*)malloc(FRAME_PAYLOAD_CAPACITY);
+    buffers->output = (char*)malloc(MAX_FRAME_SIZE + 1);
+    buffers->next = NULL;
+    if (buffers->payload == NULL || buffers->output == NULL) {
+        free_frame_buffers(buffers);
+        fprintf(stderr, "Error: Memory allocation failed for frame buffers\n");
+        return 0;
+    }
+    return 1;
+}
+
+void free_frame_buffers(struct FrameBuffers* buffers)
+{
+    free(buffers->payload);
+    free(buffers->output);
+    buffers->payload = NULL;
+    buffers->output = NULL;
+}
+
+/* Compress, encrypt and write one record frame */
+static int write_frame(FILE* file, const struct CipherKey* key, const struct Record* record,
+                       struct FrameBuffers* buffers)
+{
+    int data_length = strlen(record->data);
+
+    /* A frame with no payload would read back as a delete marker */
+    if (data_length == 0) {
+        fprintf(stderr, "Error: Record %u is empty\n", record->id);
+        return 0;
+    }
+    if (data_length > MAX_FRAME_SIZE) {
+        fprintf(stderr, "Error: Record %u is too large to store\n", record->id);
+        return 0;
+    }
+
+    /* Compress the data; the payload buffer covers the worst case expansion */
+    char* compressed_data = buffers->payload;
+    int compressed_length = compress_rle(record->data, data_length, compressed_data, FRAME_PAYLOAD_CAPACITY);
+
+    if (compressed_length > MAX_FRAME_SIZE) {
+        fprintf(stderr, "Error: Record %u is too large to store\n", record->id);
+        return 0;
+    }
+
+    /* Encrypt the compressed data under a nonce used for this frame only */
+    struct FrameHeader frame;
+    frame.length = (unsigned long)compressed_length;
+    frame.id = record->id;
+    frame.created = record->created;
+    frame.modified = record->modified;
+    frame.generation = record->generation;
+    next_frame_nonce(frame.nonce);
+    crypt_frame_payload(key, ARCHIVE_VERSION, frame.nonce, compressed_data, frame.length);
+
+    return write_raw_frame(file, &frame, compressed_data);
+}
+
+/* State shared by the frame loops of one scan_records call */
+struct ScanState {
+    FILE* file;
+    int version;
+    const struct CipherKey* key;
+    const struct RecordFilter* filter;
+    struct FrameBuffers* buffers;
+    record_visitor visit;
+    void* context;
+    unsigned int position;  /* running frame number, the ID of version 1 frames */
+    int visited;
+    int stopped;            /* set once the visitor asks to stop */
+};
+
+/* True if a frame header passes the filter's ID and time constraints */
+static int frame_matches(const struct RecordFilter* filter, const struct FrameHeader* frame)
+{
+    int timed = filter != NULL && (filter->since != 0 || filter->until != 0);
+
+    /* Frames with no known time never match a time bound */
+    return filter == NULL ||
+           ((filter->id == 0 || frame->id == filter->id) &&
+            (!timed || frame->modified != 0) &&
+            (filter->since == 0 || frame->modified >= filter->since) &&
+            (filter->until == 0 || frame->modified <= filter->until));
+}
+
+/* Visit up to max_frames frames (-1 for all) from the current position,
+ * skipping the payload of frames the header alone rules out. Returns 0
+ * once the end of the file, a corrupt frame or a stop is reached. */
+static int scan_frames(struct ScanState* scan, long max_frames)
+{
+    const struct RecordFilter* filter = scan->filter;
+    struct FrameHeader frame;
+    struct Record record;
+
+    while (max_frames != 0 && read_frame_header(scan->file, scan->version, scan->position++, &frame) > 0) {
+        if (max_frames > 0) {
+            max_frames--;
         }
 
-        if (fread(compressed_data, 1, record_length, file) != record_length) {
-            free(compressed_data);
-            break;
+        if (!frame_length_valid(scan->version, &frame)) { 
+            return 0;
         }
 
-        /* Decrypt the data */
-        xor_encrypt(compressed_data, record_length, password[0]);
+        /* Delete markers only matter to backups; the records they name
+         * were already removed from the file */
+        if (frame.length == 0) {
+            continue;
+        }
 
-        /* Decompress the RLE data */
-        char* decompressed_data = malloc(65536); /* Max 64KB */
-        if (decompressed_data == NULL) {
-            free(compressed_data);
-            fclose(file);
-            return records_loaded;
+        /* Frames ruled out by their header are skipped without being decoded */
+        if (!frame_matches(filter, &frame)) {
+            if (fseek(scan->file, (long)frame.length, SEEK_CUR) != 0) {
+                return 0;
+            }
+            continue;
         }
 
-        int decompressed_length = decompress_rle(compressed_data, record_length, decompressed_data, 65536);
-        free(compressed_data);
+        if (fread(scan->buffers->payload, 1, frame.length, scan->file) != frame.length) {
+            return 0;
+        }
 
-        if (decompressed_length <= 0) {
-            free(decompressed_data);
-            break;
+        if (decode_frame(scan->buffers->payload, &frame, scan->version, scan->key, scan->buffers->output) < 0) {
+            return 0;
         }
 
-        decompressed_data[decompressed_length] = '\0';
+        if (filter != NULL && filter->term != NULL && strstr(scan->buffers->output, filter->term) == NULL) {
+            continue;
+        }
 
-        /* Create record */
-        struct Record* record = create_record(next_id++, decompressed_data);
-        free(decompressed_data);
+        record.id = frame.id;
+        record.data = scan->buffers->output;
+        record.created = frame.created;
+        record.modified = frame.modified;
+        record.generation = frame.generation;
+        record.next = NULL;
 
-        if (record != NULL) {
-            add_record(head, record);
-            records_loaded++;
+        scan->visited++;
+        if (!scan->visit(&record, scan->context)) {
+            scan->stopped = 1;
+            return 0;
         }
     }
+    return max_frames == 0;
+}
 
-    fclose(file);
+/* Decode the records of an archive file that match filter (NULL for
+ * all), passing each to visit until it returns 0. The record handed to
+ * visit lives in buffers and is only valid during the call. Time-bounded
+ * scans consult the file's time index to seek straight past regions
+ * whose modification times cannot match. Returns the number of records
+ * visited. */
+int scan_records(const char* filename, const struct CipherKey* key, const struct RecordFilter* filter,
+                 struct FrameBuffers* buffers, record_visitor visit, void* context)
+{
+    struct ScanState scan;
+    struct TimeIndex index;
+
+    scan.file = fopen(filename, "rb");
+    if (scan.file == NULL) {
+        return 0; /* No file exists yet */
+    }
+
+    scan.version = read_archive_header_for_key(scan.file, filename, key);
+    if (scan.version <= 0) {
+        fclose(scan.file);
+        if (scan.version == 0) {
+            fprintf(stderr, "Error: Invalid archive format\n");
+        }
+        return 0;
+    }
+
+    scan.key = key;
+    scan.filter = filter;
+    scan.buffers = buffers;
+    scan.visit = visit;
+    scan.context = context;
+    scan.position = 1;
+    scan.visited = 0;
+    scan.stopped = 0;
+
+    if (filter != NULL && (filter->since != 0 || filter->until != 0) &&
+        scan.version >= 3 && load_time_index(filename, &index)) {
+        int i;
+        int ok = 1;
+
+        for (i = 0; ok && i < index.count; i++) {
+            const struct TimeRegion* region = &index.regions[i];
+            if ((filter->since != 0 && region->max_time < filter->since) ||
+                (filter->until != 0 && region->min_time > filter->until)) {
+                continue;
+            }
+            ok = fseek(scan.file, region->offset, SEEK_SET) == 0 &&
+                 scan_frames(&scan, (long)region->frames);
+        }
+
+        /* Frames appended after the index was written are scanned directly */
+        if (ok && fseek(scan.file, index.covered, SEEK_SET) == 0) {
+            scan_frames(&scan, -1);
+        }
+        free_time_index(&index);
+    } else {
+        scan_frames(&scan, -1);
+    }
+
+    fclose(scan.file);
+    return scan.visited;
+}
+
+/* Visitor for load_filtered_records: keep a copy of every record */
+static int collect_record(const struct Record* record, void* context)
+{
+    struct Record* copy = copy_record(record);
+    if (copy != NULL) {
+        add_record((struct Record**)context, copy);
+    }
+    return 1;
+}
+
+/* Load records from archive file */
+int load_records(const char* filename, const struct CipherKey* key, struct Record** head)
+{
+    struct FrameBuffers buffers;
+    int records_loaded;
+
+    if (!init_frame_buffers(&buffers)) {
+        return 0;
+    }
+    records_loaded = load_filtered_records(filename, key, NULL, &buffers, head);
+    free_frame_buffers(&buffers);
+    return records_loaded;
+}
+
+/* Load the records matching filter (NULL for all) from an archive file,
+ * decoding through the caller's scratch buffers */
+int load_filtered_records(const char* filename, const struct CipherKey* key,
+                          const struct RecordFilter* filter, struct FrameBuffers* buffers,
+                          struct Record** head)
+{
+    struct Record* loaded = NULL;
+    int records_loaded = scan_records(filename, key, filter, buffers, collect_record, &loaded);
+
+    if (loaded != NULL) {
+        add_record(head, loaded);
+    }
     return records_loaded;
 }
 
 /* Save records to archive file */
-int save_records(const char* filename, const char* password, const struct Record* head)
+int save_records(const char* filename, const struct CipherKey* key, const struct Record* head)
 {
+    struct FrameBuffers buffers;
+
+    if (!init_frame_buffers(&buffers)) {
+        return 0;
+    }
+
     FILE* file = fopen(filename, "wb");
     if (file == NULL) {
         fprintf(stderr, "Error: Cannot create archive file\n");
+        free_frame_buffers(&buffers);
         return 0;
     }
 
     /* Write header */
-    if (fwrite("ARCHV1\n", 1, 7, file) != 7) {
+    if (!write_archive_header(file, key)) {
         fclose(file);
+        free_frame_buffers(&buffers);
         return 0;
     }
 
@@ -192,41 +590,459 @@ int save_records(const char* filename, const char* password, const struct Record
     int records_saved = 0;
 
     while (current != NULL) {
-        int data_length = strlen(current->data);
+        if (!write_frame(file, key, current, &buffers)) {
+            break;
+        }
+        current = current->next;
+        records_saved++;
+    }
 
-        /* Compress the data */
-        char* compressed_data = malloc(data_length * 2 + 1); /* Worst case expansion */
-        if (compressed_data == NULL) {
-            fclose(file);
-            return records_saved;
+    fclose(file);
+    free_frame_buffers(&buffers);
+    update_time_index(filename, 1);
+    return records_saved;
+}
+
+/* Check that every frame of an archive file older than CIPHER_VERSION
+ * decodes under key, in place of the check value such files lack, before
+ * key is adopted for it. Their single-byte XOR leaves a wrong key's
+ * output well formed more often than not, so the run lengths are checked
+ * too: in record text most runs are one byte long, so a key under which
+ * few are, while another key would make most of them so, is refused.
+ * Keys that share their first password character cannot be told apart.
+ * A current-format file must match key's check value instead; a missing
+ * file passes. Returns 1 if key fits. */
+int archive_file_decodes(const char* filename, const struct CipherKey* key)
+{
+    unsigned long runs[256];
+    unsigned long total = 0;
+    unsigned long most = 0;
+    struct FrameHeader frame;
+    unsigned int position = 1;
+    char* payload;
+    int version;
+    int status;
+    int ok;
+    int i;
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        return 1;
+    }
+
+    version = read_archive_header_for_key(file, filename, key);
+    if (version == 0) {
+        fprintf(stderr, "Error: Invalid archive format in '%s'\n", filename);
+    }
+    if (version <= 0 || version >= CIPHER_VERSION) {
+        fclose(file);
+        return version > 0;
+    }
+
+    memset(runs, 0, sizeof(runs));
+    payload = malloc(MAX_FRAME_SIZE);
+    ok = payload != NULL;
+    while (ok && (status = read_frame_header(file, version, position++, &frame)) != 0) {
+        unsigned long pair;
+
+        ok = status > 0 && frame_length_valid(version, &frame) &&
+             fread(payload, 1, frame.length, file) == frame.length;
+        for (pair = 0; ok && pair + 1 < frame.length; pair += 2) {
+            runs[(unsigned char)payload[pair]]++;  /* run lengths as stored */
+            total++;
+        }
+        if (ok && frame.length > 0) {
+            crypt_frame_payload(key, version, frame.nonce, payload, frame.length);
+            ok = payload_decodes(payload, frame.length);
+        }
+    }
+    free(payload);
+    fclose(file);
+
+    for (i = 0; i < 256; i++) {
+        if (runs[i] > most) {
+            most = runs[i];
+        }
+    }
+    if (ok && total >= LEGACY_KEY_MIN_RUNS && most * 2 > total &&
+        runs[1 ^ (unsigned char)key->legacy] * 2 <= total) {
+        ok = 0;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Error: '%s' does not decode under this password\n", filename);
+    }
+    return ok;
+}
+
+/* Rewrite an older-format archive in the current format, frame by
+ * frame, through a temporary file. Payloads are re-encrypted but not
+ * decoded, so delete markers, generations and version 1 positional IDs
+ * all carry over. Every frame must decode under key first, since the
+ * file is keyed to it from then on. input is positioned just past its
+ * header and is closed. Returns 1 on success. */
+static int upgrade_archive_file(const char* filename, const struct CipherKey* key,
+                                FILE* input, int version)
+{
+    char temp[FILENAME_MAX];
+    struct FrameHeader frame;
+    unsigned int position = 1;
+    char* payload = malloc(MAX_FRAME_SIZE);
+    int status;
+    int ok;
+
+    if (!archive_file_decodes(filename, key)) {
+        free(payload);
+        fclose(input);
+        return 0;
+    }
+
+    sprintf(temp, "%.*s.tmp", FILENAME_MAX - 5, filename);
+    FILE* output = fopen(temp, "wb");
+    ok = output != NULL && payload != NULL && write_archive_header(output, key);
+
+    while (ok && (status = read_frame_header(input, version, position++, &frame)) != 0) {
+        ok = status > 0 && frame_length_valid(version, &frame) &&
+             fread(payload, 1, frame.length, input) == frame.length;
+        if (!ok) {
+            fprintf(stderr, "Error: Corrupt frame in '%s'\n", filename);
+            break;
+        }
+        upgrade_frame_payload(key, version, &frame, payload);
+        ok = write_raw_frame(output, &frame, payload);
+    }
+
+    free(payload);
+    fclose(input);
+    if (output != NULL && fclose(output) != 0) {
+        ok = 0;
+    }
+
+    if (!ok || rename(temp, filename) != 0) {
+        fprintf(stderr, "Error: Cannot upgrade archive file '%s'\n", filename);
+        remove(temp);
+        return 0;
+    }
+
+    update_time_index(filename, 1);
+    return 1;
+}
+
+/* Open an archive file for appending frames in the current format,
+ * creating it if needed. Archives in an older format are upgraded in
+ * full first. The file is left positioned at its end. */
+FILE* open_archive_for_append(const char* filename, const struct CipherKey* key)
+{
+    FILE* file = fopen(filename, "r+b");
+    if (file == NULL) {
+        file = fopen(filename, "w+b");
+        if (file == NULL || !write_archive_header(file, key)) {
+            fprintf(stderr, "Error: Cannot create archive file\n");
+            if (file != NULL) {
+                fclose(file);
+            }
+            return NULL;
+        }
+        return file;
+    }
+
+    /* Frames appended under another key could never be read back */
+    int version = read_archive_header_for_key(file, filename, key);
+    if (version <= 0) {
+        if (version == 0) {
+            fprintf(stderr, "Error: Invalid archive format\n");
+        }
+        fclose(file);
+        return NULL;
+    }
+
+    if (version != ARCHIVE_VERSION) {
+        if (!upgrade_archive_file(filename, key, file, version)) {
+            return NULL;
+        }
+        file = fopen(filename, "r+b");
+        if (file == NULL) {
+            return NULL;
+        }
+    }
+
+    if (fseek(file, 0, SEEK_END) != 0) {
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+/* Append a single record to the end of an archive file */
+int append_record(const char* filename, const struct CipherKey* key, const struct Record* record,
+                  struct FrameBuffers* buffers)
+{
+    FILE* file = open_archive_for_append(filename, key);
+    if (file == NULL) {
+        return 0;
+    }
+
+    int ok = write_frame(file, key, record, buffers);
+    if (fclose(file) != 0) {
+        ok = 0;
+    }
+    update_time_index(filename, 0);
+    return ok;
+}
+
+/* Highest record ID and generation in an archive file, delete markers
+ * included, read from frame headers only */
+void scan_archive_maxima(const char* filename, unsigned int* max_id, unsigned long long* max_generation)
+{
+    *max_id = 0;
+    *max_generation = 0;
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        return;
+    }
+
+    int version = read_archive_header(file);
+    unsigned int position = 1;
+    struct FrameHeader frame;
+
+    while (version != 0 && read_frame_header(file, version, position++, &frame) > 0) {
+        if (!frame_length_valid(version, &frame) ||
+            fseek(file, (long)frame.length, SEEK_CUR) != 0) {
+            break;
+        }
+        if (frame.id > *max_id) {
+            *max_id = frame.id;
+        }
+        if (frame.generation > *max_generation) {
+            *max_generation = frame.generation;
         }
+    }
 
-        int compressed_length = compress_rle(current->data, data_length, compressed_data, data_length * 2 + 1);
+    fclose(file);
+}
 
-        /* Encrypt the compressed data */
-        xor_encrypt(compressed_data, compressed_length, password[0]);
+/* Decode every frame of an archive file through the caller's buffers
+ * without keeping the records. Returns the number of records checked
+ * and stores the corrupt count in bad_frames; a truncated tail counts
+ * as one corrupt frame. */
+int verify_records(const char* filename, const struct CipherKey* key, struct FrameBuffers* buffers,
+                   int* bad_frames)
+{
+    *bad_frames = 0;
 
-        /* Write record: 4-byte length, 8-byte timestamp, compressed data */
-        unsigned char length_bytes[4];
-        unsigned char timestamp_bytes[8];
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        return 0;
+    }
 
-        write_u32_le(length_bytes, (unsigned long)compressed_length);
+    /* Frames keyed otherwise would all read as corrupt; report the file instead */
+    int version = read_archive_header_for_key(file, filename, key);
+    if (version <= 0) {
+        fclose(file);
+        *bad_frames = 1;
+        return 0;
+    }
 
-        if (fwrite(length_bytes, 1, 4, file) != 4 ||
-            fwrite(timestamp_bytes, 1, 8, file) != 8 ||
-            fwrite(compressed_data, 1, compressed_length, file) != compressed_length) {
-            free(compressed_data);
+    unsigned int position = 1;
+    int frames = 0;
+    struct FrameHeader frame;
+    int status;
+
+    while ((status = read_frame_header(file, version, position++, &frame)) != 0) {
+        if (status > 0 && frame.length == 0 && frame_length_valid(version, &frame)) {
+            continue; /* Delete marker */
+        }
+        frames++;
+        if (status < 0) {
+            (*bad_frames)++;
+            break;
+        }
+        if (!frame_length_valid(version, &frame) ||
+            fread(buffers->payload, 1, frame.length, file) != frame.length) {
+            (*bad_frames)++;
+            break;
+        }
+        if (decode_frame(buffers->payload, &frame, version, key, buffers->output) < 0) {
+            (*bad_frames)++;
+        }
+    }
+
+    fclose(file);
+    return frames;
+}
+
+static int compare_ids(const void* a, const void* b)
+{
+    unsigned int left = *(const unsigned int*)a;
+    unsigned int right = *(const unsigned int*)b;
+    return (left > right) - (left < right);
+}
+
+/* Narrow ids[0..count-1] down to the IDs that have a record in the
+ * file, reading frame headers only. Returns the new count. */
+int find_record_ids(const char* filename, unsigned int* ids, int count)
+{
+    struct FrameHeader frame;
+    unsigned int position = 1;
+    char* found;
+    int kept = 0;
+    int i;
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL || count == 0) {
+        if (file != NULL) {
             fclose(file);
-            return records_saved;
         }
+        return 0;
+    }
 
-        free(compressed_data);
-        current = current->next;
-        records_saved++;
+    found = (char*)calloc(count, 1);
+    if (found == NULL) {
+        fclose(file);
+        return 0;
     }
+    qsort(ids, count, sizeof(unsigned int), compare_ids);
+
+    int version = read_archive_header(file);
+    while (version != 0 && read_frame_header(file, version, position++, &frame) > 0) {
+        unsigned int* match;
 
+        if (!frame_length_valid(version, &frame) ||
+            fseek(file, (long)frame.length, SEEK_CUR) != 0) {
+            break;
+        }
+        match = (frame.length == 0) ? NULL :
+                (unsigned int*)bsearch(&frame.id, ids, count, sizeof(unsigned int), compare_ids);
+        if (match != NULL) {
+            found[match - ids] = 1;
+        }
+    }
     fclose(file);
-    return records_saved;
+
+    for (i = 0; i < count; i++) {
+        if (found[i]) {
+            ids[kept++] = ids[i];
+        }
+    }
+    free(found);
+    return kept;
+}
+
+/* Rewrite an archive file without the records named by markers, then
+ * append the markers themselves so backups can carry the deletion. All
+ * other frames are copied verbatim without being decoded, and the new
+ * file replaces the old one only once it is complete. Returns the number
+ * of record frames dropped, or -1 on error. */
+int remove_records(const char* filename, const struct CipherKey* key,
+                   const struct FrameHeader* markers, int count)
+{
+    char temp[FILENAME_MAX];
+    unsigned int* ids;
+    char* payload;
+    struct FrameHeader frame;
+    int dropped = 0;
+    int status;
+    int ok;
+    int i;
+
+    FILE* input = open_archive_for_append(filename, key);
+    if (input == NULL) {
+        return -1;
+    }
+
+    sprintf(temp, "%.*s.tmp", FILENAME_MAX - 5, filename);
+    FILE* output = fopen(temp, "wb");
+    ids = (unsigned int*)malloc((count > 0 ? count : 1) * sizeof(unsigned int));
+    payload = malloc(MAX_FRAME_SIZE);
+
+    ok = output != NULL && ids != NULL && payload != NULL &&
+         fseek(input, 0, SEEK_SET) == 0 && read_archive_header(input) == ARCHIVE_VERSION &&
+         write_archive_header(output, key);
+
+    if (ok) {
+        for (i = 0; i < count; i++) {
+            ids[i] = markers[i].id;
+        }
+        qsort(ids, count, sizeof(unsigned int), compare_ids);
+    }
+
+    while (ok && (status = read_frame_header(input, ARCHIVE_VERSION, 0, &frame)) != 0) {
+        ok = status > 0 && frame_length_valid(ARCHIVE_VERSION, &frame) &&
+             fread(payload, 1, frame.length, input) == frame.length;
+        if (!ok) {
+            fprintf(stderr, "Error: Corrupt frame in '%s'\n", filename);
+            break;
+        }
+
+        if (frame.length > 0 && bsearch(&frame.id, ids, count, sizeof(unsigned int), compare_ids) != NULL) {
+            dropped++;
+            continue;
+        }
+        ok = write_raw_frame(output, &frame, payload);
+    }
+
+    for (i = 0; ok && i < count; i++) {
+        ok = write_raw_frame(output, &markers[i], NULL);
+    }
+
+    free(ids);
+    free(payload);
+    fclose(input);
+    if (output != NULL && fclose(output) != 0) {
+        ok = 0;
+    }
+
+    if (!ok || rename(temp, filename) != 0) {
+        fprintf(stderr, "Error: Cannot rewrite archive file '%s'\n", filename);
+        remove(temp);
+        return -1;
+    }
+
+    update_time_index(filename, 1);
+    return dropped;
+}
+
+/* Sort a record list by ascending ID (stable merge sort) */
+void sort_records_by_id(struct Record** head)
+{
+    struct Record* left;
+    struct Record* right;
+    struct Record* slow;
+    struct Record* fast;
+    struct Record** tail;
+
+    if (*head == NULL || (*head)->next == NULL) {
+        return;
+    }
+
+    /* Split the list in half */
+    slow = *head;
+    fast = (*head)->next;
+    while (fast != NULL && fast->next != NULL) {
+        slow = slow->next;
+        fast = fast->next->next;
+    }
+    left = *head;
+    right = slow->next;
+    slow->next = NULL;
+
+    sort_records_by_id(&left);
+    sort_records_by_id(&right);
+
+    /* Merge */
+    tail = head;
+    while (left != NULL && right != NULL) {
+        if (right->id < left->id) {
+            *tail = right;
+            right = right->next;
+        } else {
+            *tail = left;
+            left = left->next;
+        }
+        tail = &(*tail)->next;
+    }
+    *tail = (left != NULL) ? left : right;
 }
 
 /* Search records by term */
@@ -237,7 +1053,7 @@ struct Record* search_records(struct Record* head, const char* term)
 
     while (current != NULL) {
         if (strstr(current->data, term) != NULL) {
-            struct Record* new_result = create_record(current->id, current->data);
+            struct Record* new_result = copy_record(current);
             add_record(&results, new_result);
         }
         current = current->next;
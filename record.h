@@ -1,21 +1,79 @@
 #ifndef RECORD_H
 #define RECORD_H
 
-/* Record structure for medical archiver */
-struct Record {
+#include <stdio.h>
+#include <time.h>
+#include "archive.h"
+#include "encrypt.h"
+
+/* Current on-disk format, written as "ARCHVn\n" at the start of each
+ * file and followed by the key salt and check value from version 5 on */
+#define ARCHIVE_VERSION 5
+#define MAX_FRAME_SIZE 65536
+#define MAX_FRAME_HEADER_SIZE 44
+#define FRAME_PAYLOAD_CAPACITY (MAX_FRAME_SIZE * 2 + 1)  /* worst case RLE output */
+
+/* Cleartext header preceding each encrypted frame. A frame with no
+ * payload is a delete marker for its ID. */
+struct FrameHeader {
+    unsigned long length;   /* encrypted payload bytes, 0 for a delete marker */
     unsigned int id;
-    char *data;
-    struct Record *next;
+    time_t created;
+    time_t modified;
+    unsigned long long generation;
+    unsigned char nonce[CHACHA_NONCE_SIZE];  /* all zero before version 5 */
+};
+
+/* Scratch space for encoding or decoding one frame. Owners that keep
+ * several sets may chain them through next. */
+struct FrameBuffers {
+    char* payload;          /* FRAME_PAYLOAD_CAPACITY bytes */
+    char* output;           /* MAX_FRAME_SIZE + 1 bytes */
+    struct FrameBuffers* next;
 };
 
 /* Function prototypes */
 struct Record* create_record(unsigned int id, const char* data);
+struct Record* copy_record(const struct Record* record);
 void add_record(struct Record** head, struct Record* new_record);
-void print_records(const struct Record* head);
 void free_records(struct Record* head);
-int load_records(const char* filename, const char* password, struct Record** head);
-int save_records(const char* filename, const char* password, const struct Record* head);
+int load_records(const char* filename, const struct CipherKey* key, struct Record** head);
+int load_filtered_records(const char* filename, const struct CipherKey* key,
+                          const struct RecordFilter* filter, struct FrameBuffers* buffers,
+                          struct Record** head);
+int scan_records(const char* filename, const struct CipherKey* key, const struct RecordFilter* filter,
+                 struct FrameBuffers* buffers, record_visitor visit, void* context);
+int save_records(const char* filename, const struct CipherKey* key, const struct Record* head);
 struct Record* find_record(struct Record* head, unsigned int id);
 struct Record* search_records(struct Record* head, const char* term);
+int append_record(const char* filename, const struct CipherKey* key, const struct Record* record,
+                  struct FrameBuffers* buffers);
+int remove_records(const char* filename, const struct CipherKey* key,
+                   const struct FrameHeader* markers, int count);
+int find_record_ids(const char* filename, unsigned int* ids, int count);
+void scan_archive_maxima(const char* filename, unsigned int* max_id, unsigned long long* max_generation);
+int verify_records(const char* filename, const struct CipherKey* key, struct FrameBuffers* buffers,
+                   int* bad_frames);
+void sort_records_by_id(struct Record** head);
+int init_frame_buffers(struct FrameBuffers* buffers);
+void free_frame_buffers(struct FrameBuffers* buffers);
+
+/* Frame-level access for modules that walk archives without decoding */
+int read_archive_header(FILE* file);
+int read_archive_keyed_header(FILE* file, unsigned char* salt, unsigned char* check);
+int write_archive_header(FILE* file, const struct CipherKey* key);
+int archive_key_matches(const struct CipherKey* key, const unsigned char* salt, const unsigned char* check);
+int read_archive_header_for_key(FILE* file, const char* filename, const struct CipherKey* key);
+int archive_file_decodes(const char* filename, const struct CipherKey* key);
+int payload_decodes(const char* payload, unsigned long length);
+int frame_header_size(int version);
+int frame_length_valid(int version, const struct FrameHeader* frame);
+int read_frame_header(FILE* file, int version, unsigned int position, struct FrameHeader* frame);
+int encode_frame_header(unsigned char* buffer, const struct FrameHeader* frame);
+int write_raw_frame(FILE* file, const struct FrameHeader* frame, const char* payload);
+void reencrypt_frame_payload(const struct CipherKey* from, int version, const struct CipherKey* to,
+                             struct FrameHeader* frame, char* payload);
+void upgrade_frame_payload(const struct CipherKey* key, int version, struct FrameHeader* frame, char* payload);
+FILE* open_archive_for_append(const char* filename, const struct CipherKey* key);
 
 #endif 
@@ -0,0 +1,525 @@
+/* rekey.c - Streaming, parallel password rotation */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "rekey.h"
+#include "record.h"
+#include "encrypt.h"
+#include "compress.h"
+#include "timeindex.h"
+
+#define BATCH_FREE 0
+#define BATCH_FILLED 1
+#define BATCH_DONE 2
+
+/* A run of whole frames copied verbatim from the source archive */
+struct RekeyBatch {
+    char* data;
+    size_t used;
+    size_t* frame_offsets;  /* start of each frame header within data */
+    int frames;
+    int state;
+};
+
+/* Ring of batches shared by the reader/writer and the worker threads.
+ * Batches are numbered in file order; batch n lives in slot n % slots. */
+struct RekeyJob {
+    struct RekeyBatch* batches;
+    int slots;
+    int version;            /* format of the source file */
+    const struct CipherKey* old_key;
+    const struct CipherKey* new_key;
+    long filled;            /* batches handed to workers so far */
+    long taken;             /* batches claimed by workers so far */
+    int bad_frames;         /* frames that did not decode under old_key */
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+/* Swap one frame's payload from the old key to the new one under a
+ * fresh nonce, which is written into the frame's header. Payloads stay
+ * compressed. Current files were matched against their header's check
+ * value already; older ones carry none, so their payloads must decode
+ * once decrypted instead. Returns 0 if such a payload does not decode. */
+static int rekey_frame(const struct RekeyJob* job, char* frame)
+{
+    unsigned char* header = (unsigned char*)frame;
+    unsigned long length = read_u32_le(header);
+    unsigned char* nonce = header + frame_header_size(ARCHIVE_VERSION) - CHACHA_NONCE_SIZE;
+    char* payload = frame + frame_header_size(ARCHIVE_VERSION);
+    int ok;
+
+    if (length == 0) {
+        return 1; /* Delete marker */
+    }
+    crypt_frame_payload(job->old_key, job->version, nonce, payload, length);
+    ok = job->version >= CIPHER_VERSION || payload_decodes(payload, length);
+    next_frame_nonce(nonce);
+    crypt_frame_payload(job->new_key, ARCHIVE_VERSION, nonce, payload, length);
+    return ok;
+}
+
+static void* rekey_worker(void* arg)
+{
+    struct RekeyJob* job = (struct RekeyJob*)arg;
+    struct RekeyBatch* batch;
+    int bad;
+    int i;
+
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+        while (!job->stop && job->taken >= job->filled) {
+            pthread_cond_wait(&job->changed, &job->lock);
+        }
+        if (job->stop) {
+            break;
+        }
+        batch = &job->batches[job->taken++ % job->slots];
+        pthread_mutex_unlock(&job->lock);
+
+        bad = 0;
+        for (i = 0; i < batch->frames; i++) {
+            if (!rekey_frame(job, batch->data + batch->frame_offsets[i])) {
+                bad++;
+            }
+        }
+
+        pthread_mutex_lock(&job->lock);
+        job->bad_frames += bad;
+        batch->state = BATCH_DONE;
+        pthread_cond_broadcast(&job->changed);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+/* Read whole frames into a batch until it holds REKEY_BATCH_SIZE bytes,
+ * storing each header in the current format. position numbers the
+ * frames of version 1 files, which have no IDs. Returns 1 if more
+ * frames may follow, 0 at end of file, -1 on a truncated or malformed
+ * frame. */
+static int fill_batch(FILE* input, int version, unsigned int* position, struct RekeyBatch* batch)
+{
+    batch->used = 0;
+    batch->frames = 0;
+
+    while (batch->used < REKEY_BATCH_SIZE && batch->frames < REKEY_BATCH_FRAMES) {
+        char* frame_data = batch->data + batch->used;
+        struct FrameHeader frame;
+        int header_size;
+        int status = read_frame_header(input, version, (*position)++, &frame);
+
+        if (status <= 0) {
+            return status;
+        }
+
+        header_size = encode_frame_header((unsigned char*)frame_data, &frame);
+        if (!frame_length_valid(version, &frame) ||
+            fread(frame_data + header_size, 1, frame.length, input) != frame.length) {
+            return -1;
+        }
+
+        batch->frame_offsets[batch->frames++] = batch->used;
+        batch->used += header_size + frame.length;
+    }
+    return 1;
+}
+
+/* fsync the directory holding path so a rename into it is durable */
+static void sync_parent_directory(const char* path)
+{
+    char directory[FILENAME_MAX];
+    const char* slash = strrchr(path, '/');
+    int fd;
+
+    if (slash == NULL) {
+        strcpy(directory, ".");
+    } else if (slash == path) {
+        strcpy(directory, "/");
+    } else {
+        sprintf(directory, "%.*s", (int)(slash - path), path);
+    }
+
+    fd = open(directory, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/* Re-encrypt every frame of filename from old_key to new_key into
+ * temp_filename, which is flushed to disk but not renamed. Frames are
+ * streamed through a bounded ring of batches: this thread reads and
+ * writes in file order while worker threads re-encrypt. Files in an
+ * older format are upgraded on the way; otherwise the layout, and so
+ * the time index, of the file is unchanged. Returns the number of
+ * frames rewritten, or -1 on error. */
+int rekey_archive_file(const char* filename, const char* temp_filename,
+                       const struct CipherKey* old_key, const struct CipherKey* new_key)
+{
+    struct RekeyJob job;
+    pthread_t threads[REKEY_MAX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = (cpus > 0) ? (int)cpus : 1;
+    int started = 0;
+    long written = 0;
+    int at_end = 0;
+    int failed = 0;
+    int frames = 0;
+    int bad_frames = 0;
+    unsigned int position = 1;
+    unsigned char salt[CIPHER_SALT_SIZE];
+    unsigned char check[CIPHER_CHECK_SIZE];
+    int version;
+    int i;
+
+    FILE* input = fopen(filename, "rb");
+    if (input == NULL) {
+        fprintf(stderr, "Error: Cannot open archive file '%s'\n", filename);
+        return -1;
+    }
+
+    version = read_archive_keyed_header(input, salt, check);
+    if (version == 0) {
+        fprintf(stderr, "Error: Invalid archive format\n");
+        fclose(input);
+        return -1;
+    }
+    if (version >= CIPHER_VERSION && !archive_key_matches(old_key, salt, check)) {
+        fprintf(stderr, "Error: '%s' is not encrypted under the current password\n", filename);
+        fclose(input);
+        return -1;
+    }
+
+    FILE* output = fopen(temp_filename, "wb");
+    if (output == NULL) {
+        fprintf(stderr, "Error: Cannot create '%s'\n", temp_filename);
+        fclose(input);
+        return -1;
+    }
+
+    setvbuf(input, NULL, _IOFBF, REKEY_BATCH_SIZE);
+    if (!write_archive_header(output, new_key)) {
+        fprintf(stderr, "Error: Cannot write '%s'\n", temp_filename);
+        failed = 1;
+    }
+
+    if (thread_count > REKEY_MAX_THREADS) {
+        thread_count = REKEY_MAX_THREADS;
+    }
+
+    /* Two batches per worker keeps every worker busy while one batch is
+     * being read and another written */
+    job.slots = thread_count * 2 + 2;
+    job.batches = (struct RekeyBatch*)calloc(job.slots, sizeof(struct RekeyBatch));
+    job.version = version;
+    job.old_key = old_key;
+    job.new_key = new_key;
+    job.filled = 0;
+    job.taken = 0;
+    job.bad_frames = 0;
+    job.stop = 0;
+
+    for (i = 0; !failed && i < job.slots; i++) {
+        if (job.batches != NULL) {
+            /* Room for one maximum-size frame past the batch threshold */
+            job.batches[i].data = (char*)malloc(REKEY_BATCH_SIZE + MAX_FRAME_HEADER_SIZE + MAX_FRAME_SIZE);
+            job.batches[i].frame_offsets = (size_t*)malloc(REKEY_BATCH_FRAMES * sizeof(size_t));
+        }
+        if (job.batches == NULL || job.batches[i].data == NULL || job.batches[i].frame_offsets == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed for re-key buffers\n");
+            failed = 1;
+        }
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.changed, NULL);
+
+    for (i = 0; !failed && i < thread_count; i++) {
+        if (pthread_create(&threads[started], NULL, rekey_worker, &job) == 0) {
+            started++;
+        }
+    }
+    if (!failed && started == 0) {
+        fprintf(stderr, "Error: Cannot start re-key threads\n");
+        failed = 1;
+    }
+
+    while (!failed) {
+        struct RekeyBatch* to_write = NULL;
+        struct RekeyBatch* to_fill = NULL;
+
+        /* Writing in order frees slots, so it takes priority over reading */
+        pthread_mutex_lock(&job.lock);
+        for (;;) {
+            if (written < job.filled && job.batches[written % job.slots].state == BATCH_DONE) {
+                to_write = &job.batches[written % job.slots];
+                break;
+            }
+            if (!at_end && job.batches[job.filled % job.slots].state == BATCH_FREE) {
+                to_fill = &job.batches[job.filled % job.slots];
+                break;
+            }
+            if (at_end && written == job.filled) {
+                break;
+            }
+            pthread_cond_wait(&job.changed, &job.lock);
+        }
+        bad_frames = job.bad_frames;
+        pthread_mutex_unlock(&job.lock);
+
+        if (to_write != NULL) {
+            if (bad_frames > 0) {
+                fprintf(stderr, "Error: Frames in '%s' do not decode under the current password\n",
+                        filename);
+                failed = 1;
+                break;
+            }
+            if (fwrite(to_write->data, 1, to_write->used, output) != to_write->used) {
+                fprintf(stderr, "Error: Cannot write '%s'\n", temp_filename);
+                failed = 1;
+                break;
+            }
+            frames += to_write->frames;
+            pthread_mutex_lock(&job.lock);
+            to_write->state = BATCH_FREE;
+            written++;
+            pthread_cond_broadcast(&job.changed);
+            pthread_mutex_unlock(&job.lock);
+        } else if (to_fill != NULL) {
+            int status = fill_batch(input, version, &position, to_fill);
+            if (status < 0) {
+                fprintf(stderr, "Error: Corrupt frame in '%s'\n", filename);
+                failed = 1;
+                break;
+            }
+            at_end = (status == 0);
+            if (to_fill->frames > 0) {
+                pthread_mutex_lock(&job.lock);
+                to_fill->state = BATCH_FILLED;
+                job.filled++;
+                pthread_cond_broadcast(&job.changed);
+                pthread_mutex_unlock(&job.lock);
+            }
+        } else {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&job.lock);
+    job.stop = 1;
+    pthread_cond_broadcast(&job.changed);
+    pthread_mutex_unlock(&job.lock);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&job.changed);
+    pthread_mutex_destroy(&job.lock);
+
+    for (i = 0; job.batches != NULL && i < job.slots; i++) {
+        free(job.batches[i].data);
+        free(job.batches[i].frame_offsets);
+    }
+    free(job.batches);
+    fclose(input);
+
+    if (fflush(output) != 0 || fsync(fileno(output)) != 0) {
+        failed = 1;
+    }
+    if (fclose(output) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        remove(temp_filename);
+        return -1;
+    }
+    return frames;
+}
+
+/* Name of a shard's re-key file with the given suffix */
+static void rekey_file_name(const struct ShardSet* set, int shard, const char* suffix, char* buffer)
+{
+    char filename[MAX_PATH_LENGTH];
+
+    shard_file_name(set, shard, filename, sizeof(filename));
+    sprintf(buffer, "%s%s", filename, suffix);
+}
+
+/* Remove the re-key files with the given suffix of every shard marked in
+ * present */
+static void remove_rekey_files(const struct ShardSet* set, const int* present, const char* suffix)
+{
+    char name[MAX_PATH_LENGTH + REKEY_SUFFIX_SPACE];
+    int shard;
+
+    for (shard = 0; shard < set->count; shard++) {
+        if (present[shard]) {
+            rekey_file_name(set, shard, suffix, name);
+            remove(name);
+        }
+    }
+}
+
+/* Put the originals of the swapped shards back from the links kept
+ * beside them. If that fails, every shard's state is reported, since the
+ * archive then mixes the two keys. Returns 1 if all were put back. */
+static int roll_back_shards(const struct ShardSet* set, const int* versions, int* swapped)
+{
+    char filename[MAX_PATH_LENGTH];
+    char original[MAX_PATH_LENGTH + REKEY_SUFFIX_SPACE];
+    int restored = 1;
+    int shard;
+
+    shard_file_name(set, 0, filename, sizeof(filename));
+    for (shard = 0; shard < set->count; shard++) {
+        if (swapped[shard]) {
+            shard_file_name(set, shard, filename, sizeof(filename));
+            rekey_file_name(set, shard, REKEY_ORIGINAL_SUFFIX, original);
+            if (rename(original, filename) == 0) {
+                swapped[shard] = 0;
+            } else {
+                restored = 0;
+            }
+        }
+    }
+    sync_parent_directory(filename);
+    if (restored) {
+        return 1;
+    }
+
+    fprintf(stderr, "Error: Cannot roll back the re-key; the archive now mixes both passwords:\n");
+    for (shard = 0; shard < set->count; shard++) {
+        if (versions[shard] < 0) {
+            continue;
+        }
+        shard_file_name(set, shard, filename, sizeof(filename));
+        if (swapped[shard]) {
+            fprintf(stderr, "  '%s' is under the new password; the original is '%s%s'\n",
+                    filename, filename, REKEY_ORIGINAL_SUFFIX);
+        } else {
+            fprintf(stderr, "  '%s' is under the old password\n", filename);
+        }
+    }
+    return 0;
+}
+
+/* Re-key every file of an archive. All shards are rewritten to temporary
+ * files first, each frame being checked to decode under old_key, and
+ * only swapped in once every one of them succeeded. Each original stays
+ * hard-linked under a second name until all shards and the manifest have
+ * switched, so a failure part way through the swap is rolled back.
+ * Returns the number of frames re-keyed, -1 on error with the archive
+ * unchanged, or ARCHIVE_REKEY_PARTIAL if a rollback failed too. */
+int rekey_archive(struct ShardSet* set, const struct CipherKey* old_key, const struct CipherKey* new_key)
+{
+    char filename[MAX_PATH_LENGTH];
+    char temp[MAX_PATH_LENGTH + REKEY_SUFFIX_SPACE];
+    char original[MAX_PATH_LENGTH + REKEY_SUFFIX_SPACE];
+    int versions[MAX_SHARDS];  /* -1 for a shard never written */
+    int written[MAX_SHARDS];   /* a temporary file exists */
+    int linked[MAX_SHARDS];    /* the original is also linked as the backup name */
+    int swapped[MAX_SHARDS];   /* the temporary file has replaced the shard */
+    struct ShardSet previous = *set;
+    int failed = 0;
+    int total = 0;
+    int shard;
+
+    memset(written, 0, sizeof(written));
+    memset(linked, 0, sizeof(linked));
+    memset(swapped, 0, sizeof(swapped));
+
+    for (shard = 0; shard < set->count; shard++) {
+        FILE* existing;
+        int frames;
+
+        shard_file_name(set, shard, filename, sizeof(filename));
+        rekey_file_name(set, shard, REKEY_TEMP_SUFFIX, temp);
+
+        existing = fopen(filename, "rb");
+        versions[shard] = -1;
+        if (existing == NULL) {
+            continue; /* Shard never written */
+        }
+        versions[shard] = read_archive_header(existing);
+        fclose(existing);
+
+        frames = rekey_archive_file(filename, temp, old_key, new_key);
+        if (frames < 0) {
+            remove_rekey_files(set, written, REKEY_TEMP_SUFFIX);
+            return -1;
+        }
+        written[shard] = 1;
+        total += frames;
+    }
+
+    for (shard = 0; !failed && shard < set->count; shard++) {
+        if (!written[shard]) {
+            continue;
+        }
+        shard_file_name(set, shard, filename, sizeof(filename));
+        rekey_file_name(set, shard, REKEY_ORIGINAL_SUFFIX, original);
+        remove(original);
+        if (link(filename, original) != 0) {
+            fprintf(stderr, "Error: Cannot keep the original of '%s' while re-keying\n", filename);
+            failed = 1;
+        } else {
+            linked[shard] = 1;
+        }
+    }
+
+    for (shard = 0; !failed && shard < set->count; shard++) {
+        if (!written[shard]) {
+            continue;
+        }
+        shard_file_name(set, shard, filename, sizeof(filename));
+        rekey_file_name(set, shard, REKEY_TEMP_SUFFIX, temp);
+        if (rename(temp, filename) != 0) {
+            fprintf(stderr, "Error: Cannot replace '%s'\n", filename);
+            failed = 1;
+        } else {
+            swapped[shard] = 1;
+        }
+    }
+    sync_parent_directory(filename);
+
+    /* Shard directories keep the new key's salt in the manifest */
+    if (!failed && set->sharded) {
+        set->keyed = 1;
+        memcpy(set->salt, new_key->salt, CIPHER_SALT_SIZE);
+        memcpy(set->check, new_key->check, CIPHER_CHECK_SIZE);
+        if (!save_shard_manifest(set)) {
+            *set = previous;
+            failed = 1;
+        }
+    }
+
+    if (failed) {
+        if (!roll_back_shards(set, versions, swapped)) {
+            /* Keep the originals of the shards left under the new key */
+            for (shard = 0; shard < set->count; shard++) {
+                linked[shard] = linked[shard] && !swapped[shard];
+            }
+            remove_rekey_files(set, linked, REKEY_ORIGINAL_SUFFIX);
+            remove_rekey_files(set, written, REKEY_TEMP_SUFFIX);
+            return ARCHIVE_REKEY_PARTIAL;
+        }
+        remove_rekey_files(set, linked, REKEY_ORIGINAL_SUFFIX);
+        remove_rekey_files(set, written, REKEY_TEMP_SUFFIX);
+        return -1;
+    }
+
+    remove_rekey_files(set, linked, REKEY_ORIGINAL_SUFFIX);
+    for (shard = 0; shard < set->count; shard++) {
+        if (swapped[shard]) {
+            /* The index is tied to the file it was built from */
+            shard_file_name(set, shard, filename, sizeof(filename));
+            update_time_index(filename, 1);
+        }
+    }
+    return total;
+}
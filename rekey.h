@@ -0,0 +1,18 @@
+#ifndef REKEY_H
+#define REKEY_H
+
+#include "shard.h"
+
+#define REKEY_BATCH_SIZE (1024 * 1024)
+#define REKEY_BATCH_FRAMES 8192
+#define REKEY_MAX_THREADS 16
+#define REKEY_TEMP_SUFFIX ".rekey"
+#define REKEY_ORIGINAL_SUFFIX ".prekey"  /* original kept until the swap completes */
+#define REKEY_SUFFIX_SPACE 8
+
+/* Streaming password rotation */
+int rekey_archive_file(const char* filename, const char* temp_filename,
+                       const struct CipherKey* old_key, const struct CipherKey* new_key);
+int rekey_archive(struct ShardSet* set, const struct CipherKey* old_key, const struct CipherKey* new_key);
+
+#endif
@@ -0,0 +1,204 @@
+/* sha256.c - SHA-256 and PBKDF2-HMAC-SHA-256 for password key derivation */
+
+#include <string.h>
+#include "sha256.h"
+
+#define ROTR32(v, n) ((((v) >> (n)) | ((v) << (32 - (n)))) & 0xffffffffU)
+
+static const unsigned int round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void sha256_block(unsigned int* state, const unsigned char* block)
+{
+    unsigned int w[64];
+    unsigned int a, b, c, d, e, f, g, h;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = ((unsigned int)block[i * 4] << 24) | ((unsigned int)block[i * 4 + 1] << 16) |
+               ((unsigned int)block[i * 4 + 2] << 8) | (unsigned int)block[i * 4 + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        unsigned int s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        unsigned int s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = (w[i - 16] + s0 + w[i - 7] + s1) & 0xffffffffU;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+    for (i = 0; i < 64; i++) {
+        unsigned int s1 = ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25);
+        unsigned int choose = (e & f) ^ (~e & g);
+        unsigned int t1 = (h + s1 + choose + round_constants[i] + w[i]) & 0xffffffffU;
+        unsigned int s0 = ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22);
+        unsigned int majority = (a & b) ^ (a & c) ^ (b & c);
+        unsigned int t2 = (s0 + majority) & 0xffffffffU;
+
+        h = g; g = f; f = e;
+        e = (d + t1) & 0xffffffffU;
+        d = c; c = b; b = a;
+        a = (t1 + t2) & 0xffffffffU;
+    }
+
+    state[0] = (state[0] + a) & 0xffffffffU;
+    state[1] = (state[1] + b) & 0xffffffffU;
+    state[2] = (state[2] + c) & 0xffffffffU;
+    state[3] = (state[3] + d) & 0xffffffffU;
+    state[4] = (state[4] + e) & 0xffffffffU;
+    state[5] = (state[5] + f) & 0xffffffffU;
+    state[6] = (state[6] + g) & 0xffffffffU;
+    state[7] = (state[7] + h) & 0xffffffffU;
+}
+
+void sha256_init(struct Sha256* context)
+{
+    context->state[0] = 0x6a09e667;
+    context->state[1] = 0xbb67ae85;
+    context->state[2] = 0x3c6ef372;
+    context->state[3] = 0xa54ff53a;
+    context->state[4] = 0x510e527f;
+    context->state[5] = 0x9b05688c;
+    context->state[6] = 0x1f83d9ab;
+    context->state[7] = 0x5be0cd19;
+    context->length = 0;
+    context->used = 0;
+}
+
+void sha256_update(struct Sha256* context, const unsigned char* data, unsigned long length)
+{
+    context->length += length;
+
+    while (length > 0) {
+        unsigned long take = SHA256_BLOCK_SIZE - context->used;
+        if (take > length) {
+            take = length;
+        }
+        memcpy(context->buffer + context->used, data, take);
+        context->used += (int)take;
+        data += take;
+        length -= take;
+
+        if (context->used == SHA256_BLOCK_SIZE) {
+            sha256_block(context->state, context->buffer);
+            context->used = 0;
+        }
+    }
+}
+
+void sha256_final(struct Sha256* context, unsigned char* digest)
+{
+    unsigned long long bits = context->length * 8;
+    int i;
+
+    context->buffer[context->used++] = 0x80;
+    if (context->used > SHA256_BLOCK_SIZE - 8) {
+        memset(context->buffer + context->used, 0, SHA256_BLOCK_SIZE - context->used);
+        sha256_block(context->state, context->buffer);
+        context->used = 0;
+    }
+    memset(context->buffer + context->used, 0, SHA256_BLOCK_SIZE - 8 - context->used);
+    for (i = 0; i < 8; i++) {
+        context->buffer[SHA256_BLOCK_SIZE - 1 - i] = (unsigned char)(bits >> (i * 8));
+    }
+    sha256_block(context->state, context->buffer);
+
+    for (i = 0; i < 8; i++) {
+        digest[i * 4] = (unsigned char)(context->state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(context->state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(context->state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)context->state[i];
+    }
+}
+
+/* The HMAC inner and outer hashes are keyed once; each iteration then
+ * starts from copies of the two keyed contexts */
+void pbkdf2_hmac_sha256(const unsigned char* password, unsigned long password_length,
+                        const unsigned char* salt, unsigned long salt_length,
+                        unsigned long iterations, unsigned char* output, unsigned long output_length)
+{
+    unsigned char key[SHA256_BLOCK_SIZE];
+    unsigned char pad[SHA256_BLOCK_SIZE];
+    unsigned char u[SHA256_DIGEST_SIZE];
+    unsigned char t[SHA256_DIGEST_SIZE];
+    unsigned char counter[4];
+    struct Sha256 inner_keyed;
+    struct Sha256 outer_keyed;
+    struct Sha256 context;
+    unsigned long block = 1;
+    unsigned long i;
+    int j;
+
+    memset(key, 0, sizeof(key));
+    if (password_length > SHA256_BLOCK_SIZE) {
+        sha256_init(&context);
+        sha256_update(&context, password, password_length);
+        sha256_final(&context, key);
+    } else {
+        memcpy(key, password, password_length);
+    }
+
+    for (j = 0; j < SHA256_BLOCK_SIZE; j++) {
+        pad[j] = key[j] ^ 0x36;
+    }
+    sha256_init(&inner_keyed);
+    sha256_update(&inner_keyed, pad, SHA256_BLOCK_SIZE);
+    for (j = 0; j < SHA256_BLOCK_SIZE; j++) {
+        pad[j] = key[j] ^ 0x5c;
+    }
+    sha256_init(&outer_keyed);
+    sha256_update(&outer_keyed, pad, SHA256_BLOCK_SIZE);
+
+    while (output_length > 0) {
+        unsigned long take = (output_length < SHA256_DIGEST_SIZE) ? output_length : SHA256_DIGEST_SIZE;
+
+        counter[0] = (unsigned char)(block >> 24);
+        counter[1] = (unsigned char)(block >> 16);
+        counter[2] = (unsigned char)(block >> 8);
+        counter[3] = (unsigned char)block;
+
+        /* U1 = HMAC(password, salt || INT(block)) */
+        context = inner_keyed;
+        sha256_update(&context, salt, salt_length);
+        sha256_update(&context, counter, 4);
+        sha256_final(&context, u);
+        context = outer_keyed;
+        sha256_update(&context, u, SHA256_DIGEST_SIZE);
+        sha256_final(&context, u);
+        memcpy(t, u, SHA256_DIGEST_SIZE);
+
+        /* Un = HMAC(password, Un-1) */
+        for (i = 1; i < iterations; i++) {
+            context = inner_keyed;
+            sha256_update(&context, u, SHA256_DIGEST_SIZE);
+            sha256_final(&context, u);
+            context = outer_keyed;
+            sha256_update(&context, u, SHA256_DIGEST_SIZE);
+            sha256_final(&context, u);
+            for (j = 0; j < SHA256_DIGEST_SIZE; j++) {
+                t[j] ^= u[j];
+            }
+        }
+
+        memcpy(output, t, take);
+        output += take;
+        output_length -= take;
+        block++;
+    }
+
+    memset(key, 0, sizeof(key));
+    memset(pad, 0, sizeof(pad));
+    memset(u, 0, sizeof(u));
+    memset(t, 0, sizeof(t));
+    memset(&inner_keyed, 0, sizeof(inner_keyed));
+    memset(&outer_keyed, 0, sizeof(outer_keyed));
+    memset(&context, 0, sizeof(context));
+}
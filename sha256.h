@@ -0,0 +1,23 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+struct Sha256 {
+    unsigned int state[8];
+    unsigned char buffer[SHA256_BLOCK_SIZE];
+    unsigned long long length;  /* bytes hashed so far */
+    int used;                   /* bytes waiting in buffer */
+};
+
+void sha256_init(struct Sha256* context);
+void sha256_update(struct Sha256* context, const unsigned char* data, unsigned long length);
+void sha256_final(struct Sha256* context, unsigned char* digest);
+
+/* PBKDF2 (RFC 8018) with HMAC-SHA-256 as the pseudorandom function */
+void pbkdf2_hmac_sha256(const unsigned char* password, unsigned long password_length,
+                        const unsigned char* salt, unsigned long salt_length,
+                        unsigned long iterations, unsigned char* output, unsigned long output_length);
+
+#endif
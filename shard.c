@@ -0,0 +1,507 @@
+/* shard.c - Sharded archive directories and parallel fan-out */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "shard.h"
+#include "record.h"
+#include "timeindex.h"
+
+/* Shared work queue for run_on_shards */
+struct ShardQueue {
+    const struct ShardSet* set;
+    shard_worker worker;
+    char* args;
+    int arg_size;
+    int next_index;
+    pthread_mutex_t lock;
+};
+
+/* Scratch buffers shared by the workers of one load_shards or
+ * verify_shards call, at least one set per worker thread */
+struct ShardBuffers {
+    struct FrameBuffers* idle;
+    pthread_mutex_t lock;
+};
+
+/* Per-shard slot for load_shards */
+struct ShardLoad {
+    const struct CipherKey* key;
+    const struct RecordFilter* filter;
+    struct ShardBuffers* buffers;
+    struct Record* head;
+    int loaded;
+};
+
+/* Per-shard slot for verify_shards */
+struct ShardVerify {
+    const struct CipherKey* key;
+    struct ShardBuffers* buffers;
+    int frames;
+    int bad_frames;
+};
+
+static void manifest_file_name(const struct ShardSet* set, char* buffer, int size)
+{
+    sprintf(buffer, "%.*s/%s", size - (int)sizeof(SHARD_MANIFEST_FILE) - 2, set->path,
+            SHARD_MANIFEST_FILE);
+}
+
+/* Parse 2 * size hex digits into bytes */
+static int parse_hex(const char* text, unsigned char* bytes, int size)
+{
+    unsigned int value;
+    int i;
+
+    if ((int)strlen(text) != size * 2) {
+        return 0;
+    }
+    for (i = 0; i < size; i++) {
+        if (sscanf(text + i * 2, "%2x", &value) != 1) {
+            return 0;
+        }
+        bytes[i] = (unsigned char)value;
+    }
+    return 1;
+}
+
+static void format_hex(const unsigned char* bytes, int size, char* text)
+{
+    int i;
+    for (i = 0; i < size; i++) {
+        sprintf(text + i * 2, "%02x", bytes[i]);
+    }
+}
+
+/* Read the manifest's shard count, sequence numbers and keying into set. Writers
+ * call it again under the writer lock, as other processes may have
+ * moved the sequence numbers on since the set was opened. */
+int read_shard_manifest(struct ShardSet* set)
+{
+    char manifest[MAX_PATH_LENGTH];
+    manifest_file_name(set, manifest, sizeof(manifest));
+
+    FILE* file = fopen(manifest, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Cannot open shard manifest '%s'\n", manifest);
+        return 0;
+    }
+
+    char magic[16];
+    char salt[CIPHER_SALT_SIZE * 2 + 1];
+    char check[CIPHER_CHECK_SIZE * 2 + 1];
+    int count;
+    unsigned long next_id;
+    unsigned long long next_generation = 1;
+    int ok = fscanf(file, "%15s shards %d next_id %lu", magic, &count, &next_id) == 3 &&
+             strcmp(magic, "ARCHSHARD1") == 0 && count >= 1 && count <= MAX_SHARDS;
+
+    /* Manifests written before generations existed lack the field */
+    if (ok && fscanf(file, " next_generation %llu", &next_generation) != 1) {
+        next_generation = 1;
+    }
+
+    /* Manifests written before per-archive salts lack the keying, which
+     * archive_open then adds */
+    set->keyed = 0;
+    if (ok && fscanf(file, " salt %32s check %32s", salt, check) == 2) {
+        ok = parse_hex(salt, set->salt, CIPHER_SALT_SIZE) && parse_hex(check, set->check, CIPHER_CHECK_SIZE);
+        set->keyed = ok;
+    }
+    fclose(file);
+
+    if (!ok) {
+        fprintf(stderr, "Error: Invalid shard manifest '%s'\n", manifest);
+        return 0;
+    }
+
+    set->count = count;
+    set->next_id = (unsigned int)next_id;
+    set->next_generation = next_generation;
+    return 1;
+}
+
+/* Open an archive path, reading the manifest if it is a shard directory */
+int open_shard_set(const char* path, struct ShardSet* set)
+{
+    struct stat info;
+
+    if (strlen(path) >= MAX_PATH_LENGTH - 32) {
+        fprintf(stderr, "Error: Archive path too long\n");
+        return 0;
+    }
+
+    strcpy(set->path, path);
+    set->sharded = 0;
+    set->count = 1;
+    set->next_id = 0;
+    set->next_generation = 0;
+    set->keyed = 0;
+
+    if (stat(path, &info) != 0 || !S_ISDIR(info.st_mode)) {
+        return 1; /* Single archive file, possibly not created yet */
+    }
+
+    set->sharded = 1;
+    if (!read_shard_manifest(set)) {
+        set->sharded = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/* Take the archive's writer lock, shared by every process and handle:
+ * an exclusive flock on "<dir>/LOCK" for a shard directory or on
+ * "<file>.lock" for a single file. The manifest and archive files are
+ * replaced by rename, so they cannot carry the lock themselves.
+ * Returns the descriptor to pass to unlock_shard_set, or -1 on error. */
+int lock_shard_set(const struct ShardSet* set)
+{
+    char lock_name[MAX_PATH_LENGTH + 8];
+    int fd;
+
+    if (set->sharded) {
+        sprintf(lock_name, "%s/%s", set->path, SHARD_LOCK_FILE);
+    } else {
+        sprintf(lock_name, "%s.lock", set->path);
+    }
+
+    fd = open(lock_name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open lock file '%s': %s\n", lock_name, strerror(errno));
+        return -1;
+    }
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "Error: Cannot lock archive '%s': %s\n", set->path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+void unlock_shard_set(int fd)
+{
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+/* Create a new, empty shard directory. Shard files are created on first write. */
+int create_shard_set(const char* path, int count, struct ShardSet* set)
+{
+    if (count < 1 || count > MAX_SHARDS) {
+        fprintf(stderr, "Error: Shard count must be between 1 and %d\n", MAX_SHARDS);
+        return 0;
+    }
+    if (strlen(path) >= MAX_PATH_LENGTH - 32) {
+        fprintf(stderr, "Error: Archive path too long\n");
+        return 0;
+    }
+
+    if (mkdir(path, 0700) != 0) {
+        fprintf(stderr, "Error: Cannot create shard directory '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    strcpy(set->path, path);
+    set->sharded = 1;
+    set->count = count;
+    set->next_id = 1;
+    set->next_generation = 1;
+    set->keyed = 0;
+
+    return save_shard_manifest(set);
+}
+
+/* Rewrite the manifest via a temporary file so readers never see a partial one */
+int save_shard_manifest(const struct ShardSet* set)
+{
+    char manifest[MAX_PATH_LENGTH];
+    char temp[MAX_PATH_LENGTH + 4];
+    char salt[CIPHER_SALT_SIZE * 2 + 1];
+    char check[CIPHER_CHECK_SIZE * 2 + 1];
+
+    manifest_file_name(set, manifest, sizeof(manifest));
+    sprintf(temp, "%s.tmp", manifest);
+
+    FILE* file = fopen(temp, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Cannot write shard manifest\n");
+        return 0;
+    }
+
+    int ok = fprintf(file, "ARCHSHARD1\nshards %d\nnext_id %u\nnext_generation %llu\n",
+                     set->count, set->next_id, set->next_generation) > 0;
+    if (ok && set->keyed) {
+        format_hex(set->salt, CIPHER_SALT_SIZE, salt);
+        format_hex(set->check, CIPHER_CHECK_SIZE, check);
+        ok = fprintf(file, "salt %s\ncheck %s\n", salt, check) > 0;
+    }
+    if (fclose(file) != 0) {
+        ok = 0;
+    }
+
+    if (!ok || rename(temp, manifest) != 0) {
+        fprintf(stderr, "Error: Cannot write shard manifest\n");
+        remove(temp);
+        return 0;
+    }
+    return 1;
+}
+
+/* Path of the file backing the given shard */
+void shard_file_name(const struct ShardSet* set, int index, char* buffer, int size)
+{
+    if (!set->sharded) {
+        sprintf(buffer, "%.*s", size - 1, set->path);
+    } else {
+        sprintf(buffer, "%.*s/shard-%03d.dat", size - 16, set->path, index);
+    }
+}
+
+/* Shard holding the given record ID (Fibonacci hash of the ID) */
+int shard_for_id(const struct ShardSet* set, unsigned int id)
+{
+    unsigned long hash = ((unsigned long)id * 2654435761UL) & 0xFFFFFFFFUL;
+    return (int)(hash % (unsigned long)set->count);
+}
+
+/* Reserve a run of record IDs and a run of generations for upcoming
+ * writes. The caller must hold the writer lock (lock_shard_set) until
+ * those writes are done, since other processes may share the archive.
+ * Sharded archives re-read the manifest under that lock and persist the
+ * reservation before anything is written, so a failed write never reuses
+ * a number; single files derive the next values from their time index
+ * and the frame headers it does not cover yet. */
+int reserve_sequence_numbers(struct ShardSet* set, int ids, int generations,
+                             unsigned int* first_id, unsigned long long* first_generation)
+{
+    if (!set->sharded) {
+        unsigned int max_id;
+        unsigned long long max_generation;
+
+        index_archive_maxima(set->path, &max_id, &max_generation);
+        *first_id = max_id + 1;
+        *first_generation = max_generation + 1;
+        return 1;
+    }
+
+    if (!read_shard_manifest(set)) {
+        return 0;
+    }
+    *first_id = set->next_id;
+    *first_generation = set->next_generation;
+    set->next_id += ids;
+    set->next_generation += generations;
+    return save_shard_manifest(set);
+}
+
+static void* shard_thread(void* arg)
+{
+    struct ShardQueue* queue = (struct ShardQueue*)arg;
+    int index;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        index = queue->next_index++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (index >= queue->set->count) {
+            break;
+        }
+        queue->worker(queue->set, index, queue->args + (size_t)index * queue->arg_size);
+    }
+    return NULL;
+}
+
+/* Number of threads run_on_shards spreads set's shards over: one per
+ * online CPU, but no more than there are shards */
+int shard_thread_count(const struct ShardSet* set)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus > 0 && cpus < set->count) {
+        return (int)cpus;
+    }
+    return set->count;
+}
+
+/* Run worker once for every shard, spreading shards over up to
+ * shard_thread_count threads. args is an array of set->count slots of
+ * arg_size bytes; each call receives its own slot. */
+void run_on_shards(const struct ShardSet* set, shard_worker worker, void* args, int arg_size)
+{
+    struct ShardQueue queue;
+    pthread_t threads[MAX_SHARDS];
+    int thread_count = shard_thread_count(set);
+    int started = 0;
+    int i;
+
+    queue.set = set;
+    queue.worker = worker;
+    queue.args = (char*)args;
+    queue.arg_size = arg_size;
+    queue.next_index = 0;
+
+    if (thread_count <= 1) {
+        for (i = 0; i < set->count; i++) {
+            worker(set, i, queue.args + (size_t)i * arg_size);
+        }
+        return;
+    }
+
+    pthread_mutex_init(&queue.lock, NULL);
+
+    /* The calling thread works the queue too, so a failed spawn only costs parallelism */
+    for (i = 0; i < thread_count - 1; i++) {
+        if (pthread_create(&threads[started], NULL, shard_thread, &queue) == 0) {
+            started++;
+        }
+    }
+    shard_thread(&queue);
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&queue.lock);
+}
+
+static struct FrameBuffers* take_shard_buffers(struct ShardBuffers* buffers)
+{
+    struct FrameBuffers* taken;
+
+    pthread_mutex_lock(&buffers->lock);
+    taken = buffers->idle;
+    buffers->idle = taken->next;
+    pthread_mutex_unlock(&buffers->lock);
+    return taken;
+}
+
+static void return_shard_buffers(struct ShardBuffers* buffers, struct FrameBuffers* taken)
+{
+    pthread_mutex_lock(&buffers->lock);
+    taken->next = buffers->idle;
+    buffers->idle = taken;
+    pthread_mutex_unlock(&buffers->lock);
+}
+
+static void load_shard_worker(const struct ShardSet* set, int index, void* arg)
+{
+    struct ShardLoad* load = (struct ShardLoad*)arg;
+    struct FrameBuffers* buffers = take_shard_buffers(load->buffers);
+    char filename[MAX_PATH_LENGTH];
+
+    shard_file_name(set, index, filename, sizeof(filename));
+    load->loaded = load_filtered_records(filename, load->key, load->filter, buffers, &load->head);
+    return_shard_buffers(load->buffers, buffers);
+}
+
+/* Load every shard in parallel into heads[0..count-1], keeping only
+ * records that match filter when it is not NULL. *buffers is a list of
+ * at least shard_thread_count(set) scratch sets linked through next;
+ * it may come back in a different order. Returns the total. */
+int load_shards(const struct ShardSet* set, const struct CipherKey* key,
+                const struct RecordFilter* filter, struct FrameBuffers** buffers,
+                struct Record** heads)
+{
+    struct ShardLoad* loads = (struct ShardLoad*)calloc(set->count, sizeof(struct ShardLoad));
+    struct ShardBuffers shared;
+    int total = 0;
+    int i;
+
+    if (loads == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for shard loads\n");
+        return 0;
+    }
+
+    shared.idle = *buffers;
+    pthread_mutex_init(&shared.lock, NULL);
+    for (i = 0; i < set->count; i++) {
+        loads[i].key = key;
+        loads[i].filter = filter;
+        loads[i].buffers = &shared;
+    }
+
+    run_on_shards(set, load_shard_worker, loads, sizeof(struct ShardLoad));
+    pthread_mutex_destroy(&shared.lock);
+    *buffers = shared.idle;
+
+    for (i = 0; i < set->count; i++) {
+        heads[i] = loads[i].head;
+        total += loads[i].loaded;
+    }
+
+    free(loads);
+    return total;
+}
+
+/* Join per-shard lists into one list ordered by ID. The heads are consumed. */
+struct Record* merge_shards(struct Record** heads, int count)
+{
+    struct Record* merged = NULL;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (heads[i] != NULL) {
+            add_record(&merged, heads[i]);
+            heads[i] = NULL;
+        }
+    }
+    sort_records_by_id(&merged);
+    return merged;
+}
+
+static void verify_shard_worker(const struct ShardSet* set, int index, void* arg)
+{
+    struct ShardVerify* verify = (struct ShardVerify*)arg;
+    struct FrameBuffers* buffers = take_shard_buffers(verify->buffers);
+    char filename[MAX_PATH_LENGTH];
+
+    shard_file_name(set, index, filename, sizeof(filename));
+    verify->frames = verify_records(filename, verify->key, buffers, &verify->bad_frames);
+    return_shard_buffers(verify->buffers, buffers);
+}
+
+/* Verify every shard in parallel, filling per-shard frame and corrupt
+ * counts. *buffers is handled as by load_shards. Returns the total
+ * number of corrupt frames. */
+int verify_shards(const struct ShardSet* set, const struct CipherKey* key, struct FrameBuffers** buffers,
+                  int* frames, int* bad_frames)
+{
+    struct ShardVerify* verifies = (struct ShardVerify*)calloc(set->count, sizeof(struct ShardVerify));
+    struct ShardBuffers shared;
+    int total_bad = 0;
+    int i;
+
+    if (verifies == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for shard verification\n");
+        return -1;
+    }
+
+    shared.idle = *buffers;
+    pthread_mutex_init(&shared.lock, NULL);
+    for (i = 0; i < set->count; i++) {
+        verifies[i].key = key;
+        verifies[i].buffers = &shared;
+    }
+
+    run_on_shards(set, verify_shard_worker, verifies, sizeof(struct ShardVerify));
+    pthread_mutex_destroy(&shared.lock);
+    *buffers = shared.idle;
+
+    for (i = 0; i < set->count; i++) {
+        frames[i] = verifies[i].frames;
+        bad_frames[i] = verifies[i].bad_frames;
+        total_bad += verifies[i].bad_frames;
+    }
+
+    free(verifies);
+    return total_bad;
+}
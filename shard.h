@@ -0,0 +1,52 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "record.h"
+
+#define MAX_SHARDS 256
+#define MAX_PATH_LENGTH 1024
+#define SHARD_MANIFEST_FILE "MANIFEST"
+#define SHARD_LOCK_FILE "LOCK"
+
+/* An archive is either a single file or a directory of shard files.
+ * Records are partitioned across shards by a hash of their ID and the
+ * directory's manifest keeps the shard count, the next free ID, the
+ * next generation, which orders writes across all shards, and the key
+ * salt and check value shared by every shard. */
+struct ShardSet {
+    char path[MAX_PATH_LENGTH];
+    int sharded;            /* 0 for a plain single-file archive */
+    int count;              /* number of shard files, 1 if not sharded */
+    unsigned int next_id;   /* next free record ID (sharded only) */
+    unsigned long long next_generation;  /* (sharded only) */
+    int keyed;              /* salt and check are set (sharded only) */
+    unsigned char salt[CIPHER_SALT_SIZE];
+    unsigned char check[CIPHER_CHECK_SIZE];
+};
+
+/* Called once per shard; arg points at that shard's slot in the args array */
+typedef void (*shard_worker)(const struct ShardSet* set, int index, void* arg);
+
+/* Shard set management */
+int open_shard_set(const char* path, struct ShardSet* set);
+int create_shard_set(const char* path, int count, struct ShardSet* set);
+int read_shard_manifest(struct ShardSet* set);
+int save_shard_manifest(const struct ShardSet* set);
+void shard_file_name(const struct ShardSet* set, int index, char* buffer, int size);
+int shard_for_id(const struct ShardSet* set, unsigned int id);
+int lock_shard_set(const struct ShardSet* set);
+void unlock_shard_set(int fd);
+int reserve_sequence_numbers(struct ShardSet* set, int ids, int generations,
+                             unsigned int* first_id, unsigned long long* first_generation);
+
+/* Parallel fan-out across shards */
+int shard_thread_count(const struct ShardSet* set);
+void run_on_shards(const struct ShardSet* set, shard_worker worker, void* args, int arg_size);
+int load_shards(const struct ShardSet* set, const struct CipherKey* key,
+                const struct RecordFilter* filter, struct FrameBuffers** buffers,
+                struct Record** heads);
+struct Record* merge_shards(struct Record** heads, int count);
+int verify_shards(const struct ShardSet* set, const struct CipherKey* key, struct FrameBuffers** buffers,
+                  int* frames, int* bad_frames);
+
+#endif
@@ -0,0 +1,368 @@
+/* timeindex.c - Per-region time summaries for skipping archive frames */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "timeindex.h"
+#include "record.h"
+#include "compress.h"
+
+#define TIME_INDEX_MAGIC "ARCHTIX4"
+#define TIME_HEADER_SIZE (40 + TIME_INDEX_ANCHOR_SIZE)
+#define TIME_ENTRY_SIZE 36
+
+static void time_index_file_name(const char* filename, char* buffer, int size)
+{
+    sprintf(buffer, "%.*s%s", size - (int)sizeof(TIME_INDEX_SUFFIX), filename, TIME_INDEX_SUFFIX);
+}
+
+/* Record which archive file an index describes: its inode and the
+ * leading bytes of its first frame header, zero padded. file must be
+ * positioned just past the archive header; it is left there. */
+static int read_archive_identity(FILE* file, unsigned long long* inode, unsigned char* anchor)
+{
+    struct stat info;
+    long first = ftell(file);
+
+    if (first < 0 || fstat(fileno(file), &info) != 0) {
+        return 0;
+    }
+    *inode = (unsigned long long)info.st_ino;
+
+    memset(anchor, 0, TIME_INDEX_ANCHOR_SIZE);
+    fread(anchor, 1, TIME_INDEX_ANCHOR_SIZE, file);
+    return fseek(file, first, SEEK_SET) == 0;
+}
+
+/* Check that a region starts on a frame header whose times and
+ * generation fall inside the region's summary */
+static int region_valid(FILE* file, int version, long first, const struct TimeIndex* index,
+                        const struct TimeRegion* region, long previous)
+{
+    struct FrameHeader frame;
+
+    if (region->offset < first || region->offset <= previous || region->offset >= index->covered ||
+        region->frames == 0 || region->frames > TIME_REGION_FRAMES ||
+        region->min_time > region->max_time) {
+        return 0;
+    }
+    if (fseek(file, region->offset, SEEK_SET) != 0 ||
+        read_frame_header(file, version, 0, &frame) != 1 ||
+        !frame_length_valid(version, &frame) ||
+        region->offset + frame_header_size(version) + (long)frame.length > index->covered) {
+        return 0;
+    }
+    return frame.modified >= region->min_time && frame.modified <= region->max_time &&
+           frame.generation <= region->max_generation;
+}
+
+/* Read the index for an archive file, checking every region against the
+ * archive if check_all is set and only the last one otherwise. Returns 0
+ * if it is missing or corrupt, or does not match the archive. */
+static int read_time_index(const char* filename, struct TimeIndex* index, int check_all)
+{
+    char index_name[FILENAME_MAX];
+    unsigned char header[TIME_HEADER_SIZE];
+    unsigned char entry[TIME_ENTRY_SIZE];
+    unsigned long long inode;
+    unsigned char anchor[TIME_INDEX_ANCHOR_SIZE];
+    struct stat info;
+    FILE* archive;
+    FILE* file;
+    long first;
+    int version;
+    int ok;
+    int i;
+
+    index->regions = NULL;
+    index->count = 0;
+    index->covered = 0;
+    index->max_id = 0;
+    index->max_generation = 0;
+
+    archive = fopen(filename, "rb");
+    if (archive == NULL) {
+        return 0;
+    }
+    version = read_archive_header(archive);
+    first = ftell(archive);
+    if (version < 3 || fstat(fileno(archive), &info) != 0 ||
+        !read_archive_identity(archive, &inode, anchor)) {
+        fclose(archive);
+        return 0;
+    }
+
+    time_index_file_name(filename, index_name, sizeof(index_name));
+    file = fopen(index_name, "rb");
+    if (file == NULL) {
+        fclose(archive);
+        return 0;
+    }
+
+    ok = fread(header, 1, TIME_HEADER_SIZE, file) == TIME_HEADER_SIZE &&
+         memcmp(header, TIME_INDEX_MAGIC, 8) == 0;
+    if (ok) {
+        index->covered = (long)read_u64_le(header + 8);
+        index->count = (int)read_u32_le(header + 16);
+        index->inode = read_u64_le(header + 20);
+        index->max_id = (unsigned int)read_u32_le(header + 28);
+        index->max_generation = read_u64_le(header + 32);
+        memcpy(index->anchor, header + 40, TIME_INDEX_ANCHOR_SIZE);
+
+        ok = index->inode == inode && memcmp(index->anchor, anchor, TIME_INDEX_ANCHOR_SIZE) == 0 &&
+             index->covered >= first && index->covered <= (long)info.st_size &&
+             index->count >= 0 && index->count <= (index->covered - first) / frame_header_size(version);
+    }
+
+    if (ok && index->count > 0) {
+        index->regions = (struct TimeRegion*)malloc(index->count * sizeof(struct TimeRegion));
+        ok = index->regions != NULL;
+    }
+
+    for (i = 0; ok && i < index->count; i++) {
+        if (fread(entry, 1, TIME_ENTRY_SIZE, file) != TIME_ENTRY_SIZE) {
+            ok = 0;
+            break;
+        }
+        index->regions[i].offset = (long)read_u64_le(entry);
+        index->regions[i].frames = (unsigned int)read_u32_le(entry + 8);
+        index->regions[i].min_time = (time_t)read_u64_le(entry + 12);
+        index->regions[i].max_time = (time_t)read_u64_le(entry + 20);
+        index->regions[i].max_generation = read_u64_le(entry + 28);
+
+        if (check_all || i == index->count - 1) {
+            ok = region_valid(archive, version, first, index, &index->regions[i],
+                              (i > 0) ? index->regions[i - 1].offset : first - 1);
+        }
+    }
+
+    fclose(file);
+    fclose(archive);
+    if (!ok) {
+        free_time_index(index);
+        index->covered = 0;
+    }
+    return ok;
+}
+
+/* Read the index for an archive file. Returns 0 if it is missing or
+ * corrupt, or does not match the archive: built from another file, or
+ * describing data the archive no longer holds at the recorded offsets.
+ * Callers then fall back to scanning every frame. */
+int load_time_index(const char* filename, struct TimeIndex* index)
+{
+    return read_time_index(filename, index, 1);
+}
+
+static int save_time_index(const char* filename, const struct TimeIndex* index)
+{
+    char index_name[FILENAME_MAX];
+    char temp[FILENAME_MAX + 4];
+    unsigned char header[TIME_HEADER_SIZE];
+    unsigned char entry[TIME_ENTRY_SIZE];
+    int ok;
+    int i;
+
+    time_index_file_name(filename, index_name, sizeof(index_name));
+    sprintf(temp, "%s.tmp", index_name);
+
+    FILE* file = fopen(temp, "wb");
+    if (file == NULL) {
+        return 0;
+    }
+
+    memcpy(header, TIME_INDEX_MAGIC, 8);
+    write_u64_le(header + 8, (unsigned long long)index->covered);
+    write_u32_le(header + 16, (unsigned long)index->count);
+    write_u64_le(header + 20, index->inode);
+    write_u32_le(header + 28, (unsigned long)index->max_id);
+    write_u64_le(header + 32, index->max_generation);
+    memcpy(header + 40, index->anchor, TIME_INDEX_ANCHOR_SIZE);
+    ok = fwrite(header, 1, TIME_HEADER_SIZE, file) == TIME_HEADER_SIZE;
+
+    for (i = 0; ok && i < index->count; i++) {
+        write_u64_le(entry, (unsigned long long)index->regions[i].offset);
+        write_u32_le(entry + 8, (unsigned long)index->regions[i].frames);
+        write_u64_le(entry + 12, (unsigned long long)index->regions[i].min_time);
+        write_u64_le(entry + 20, (unsigned long long)index->regions[i].max_time);
+        write_u64_le(entry + 28, index->regions[i].max_generation);
+        ok = fwrite(entry, 1, TIME_ENTRY_SIZE, file) == TIME_ENTRY_SIZE;
+    }
+
+    if (fclose(file) != 0) {
+        ok = 0;
+    }
+    if (!ok || rename(temp, index_name) != 0) {
+        remove(temp);
+        return 0;
+    }
+    return 1;
+}
+
+static int push_region(struct TimeIndex* index, const struct TimeRegion* region)
+{
+    struct TimeRegion* grown = (struct TimeRegion*)realloc(index->regions,
+                                   (index->count + 1) * sizeof(struct TimeRegion));
+    if (grown == NULL) {
+        return 0;
+    }
+    index->regions = grown;
+    index->regions[index->count++] = *region;
+    return 1;
+}
+
+/* Bring the index up to date with the archive by scanning frame headers
+ * from the end of the last full region, or from the start if rebuild is
+ * set or no usable index exists. Payloads are skipped, never decoded.
+ * Only the last region is checked against the archive, so appending one
+ * frame costs the same however long the archive is. */
+int update_time_index(const char* filename, int rebuild)
+{
+    struct TimeIndex index;
+    struct TimeRegion region;
+    struct FrameHeader frame;
+    unsigned long long inode;
+    unsigned char anchor[TIME_INDEX_ANCHOR_SIZE];
+    int version;
+    int ok = 1;
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+
+    version = read_archive_header(file);
+    if (version < 3 || !read_archive_identity(file, &inode, anchor)) {
+        /* Older formats carry no timestamps worth indexing */
+        fclose(file);
+        return 0;
+    }
+
+    if (rebuild || !read_time_index(filename, &index, 0)) {
+        index.regions = NULL;
+        index.count = 0;
+        index.covered = ftell(file);
+        index.max_id = 0;
+        index.max_generation = 0;
+    }
+    index.inode = inode;
+    memcpy(index.anchor, anchor, TIME_INDEX_ANCHOR_SIZE);
+
+    /* A trailing partial region is rescanned so it can fill up */
+    if (index.count > 0 && index.regions[index.count - 1].frames < TIME_REGION_FRAMES) {
+        index.covered = index.regions[--index.count].offset;
+    }
+
+    if (fseek(file, index.covered, SEEK_SET) != 0) {
+        fclose(file);
+        free_time_index(&index);
+        return 0;
+    }
+
+    region.frames = 0;
+    for (;;) {
+        long offset = ftell(file);
+        if (read_frame_header(file, version, 0, &frame) <= 0 ||
+            !frame_length_valid(version, &frame) ||
+            fseek(file, (long)frame.length, SEEK_CUR) != 0) {
+            break;
+        }
+
+        if (region.frames == 0) {
+            region.offset = offset;
+            region.min_time = frame.modified;
+            region.max_time = frame.modified;
+            region.max_generation = frame.generation;
+        } else {
+            if (frame.modified < region.min_time) {
+                region.min_time = frame.modified;
+            } else if (frame.modified > region.max_time) {
+                region.max_time = frame.modified;
+            }
+            if (frame.generation > region.max_generation) {
+                region.max_generation = frame.generation;
+            }
+        }
+        if (frame.id > index.max_id) {
+            index.max_id = frame.id;
+        }
+        if (frame.generation > index.max_generation) {
+            index.max_generation = frame.generation;
+        }
+        region.frames++;
+        index.covered = ftell(file);
+
+        if (region.frames == TIME_REGION_FRAMES) {
+            ok = ok && push_region(&index, &region);
+            region.frames = 0;
+        }
+    }
+    if (region.frames > 0) {
+        ok = ok && push_region(&index, &region);
+    }
+    fclose(file);
+
+    ok = ok && save_time_index(filename, &index);
+    free_time_index(&index);
+    return ok;
+}
+
+/* Highest record ID and generation in an archive file, delete markers
+ * included, as scan_archive_maxima finds them. The index supplies the
+ * values for the frames it covers, so only frames appended after it was
+ * written are read; without a usable index every frame header is. */
+void index_archive_maxima(const char* filename, unsigned int* max_id, unsigned long long* max_generation)
+{
+    struct TimeIndex index;
+    struct FrameHeader frame;
+    struct stat info;
+    int version;
+    int complete;
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        *max_id = 0;
+        *max_generation = 0;
+        return;
+    }
+
+    version = read_archive_header(file);
+    if (version < 3 || !read_time_index(filename, &index, 0)) {
+        fclose(file);
+        scan_archive_maxima(filename, max_id, max_generation);
+        return;
+    }
+    free_time_index(&index);
+    *max_id = index.max_id;
+    *max_generation = index.max_generation;
+
+    complete = fseek(file, index.covered, SEEK_SET) == 0;
+    while (complete && read_frame_header(file, version, 0, &frame) > 0) {
+        if (!frame_length_valid(version, &frame) ||
+            fseek(file, (long)frame.length, SEEK_CUR) != 0) {
+            complete = 0;
+            break;
+        }
+        if (frame.id > *max_id) {
+            *max_id = frame.id;
+        }
+        if (frame.generation > *max_generation) {
+            *max_generation = frame.generation;
+        }
+    }
+
+    /* The tail must end exactly at end of file, or the index is misplaced */
+    complete = complete && fstat(fileno(file), &info) == 0 && ftell(file) == (long)info.st_size;
+    fclose(file);
+    if (!complete) {
+        scan_archive_maxima(filename, max_id, max_generation);
+    }
+}
+
+void free_time_index(struct TimeIndex* index)
+{
+    free(index->regions);
+    index->regions = NULL;
+    index->count = 0;
+}
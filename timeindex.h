@@ -0,0 +1,37 @@
+#ifndef TIMEINDEX_H
+#define TIMEINDEX_H
+
+#include <time.h>
+
+/* Sidecar file ("<archive>.tix") summarising frame modification times
+ * and generations, and the highest ID and generation of the archive */
+#define TIME_INDEX_SUFFIX ".tix"
+#define TIME_REGION_FRAMES 64
+#define TIME_INDEX_ANCHOR_SIZE 44   /* bytes of the archive's first frame header kept */
+
+/* Min/max modification time and newest generation of a run of
+ * consecutive frames */
+struct TimeRegion {
+    long offset;            /* file offset of the region's first frame */
+    unsigned int frames;    /* up to TIME_REGION_FRAMES */
+    time_t min_time;
+    time_t max_time;
+    unsigned long long max_generation;
+};
+
+struct TimeIndex {
+    struct TimeRegion* regions;
+    int count;
+    long covered;           /* offset just past the last indexed frame */
+    unsigned long long inode;   /* archive file the index was built from */
+    unsigned int max_id;        /* highest ID of any covered frame */
+    unsigned long long max_generation;  /* highest generation of any covered frame */
+    unsigned char anchor[TIME_INDEX_ANCHOR_SIZE];  /* its first frame header, zero padded */
+};
+
+int load_time_index(const char* filename, struct TimeIndex* index);
+int update_time_index(const char* filename, int rebuild);
+void index_archive_maxima(const char* filename, unsigned int* max_id, unsigned long long* max_generation);
+void free_time_index(struct TimeIndex* index);
+
+#endif